@@ -13,9 +13,23 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <limits.h>
+#include <regex.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
 
 /***DEFINES***/
 
@@ -23,6 +37,34 @@
 #define TAB_STOP 8
 #define CNTRL_KEY(k) ((k) & 0x1f)
 #define QUIT_TIMES 3
+#ifndef LAZY_OPEN_MIN
+#define LAZY_OPEN_MIN (1 << 20)                 //Files at least this big are mapped instead of read
+#endif
+#define LAZY_RELEASE_CHUNK (64 << 20)           //Drop indexed pages from RSS every this many bytes
+#define PASTE_TIMEOUT_MS 1000                   //Give up on a paste whose end marker never arrives
+#ifndef INPUT_BUF_SIZE
+#define INPUT_BUF_SIZE (1 << 16)                //Ring buffer for terminal input, a power of two
+#endif
+#define ESC_TIMEOUT_MS 100                      //How long the rest of an escape sequence may take
+#ifndef FRAME_MS
+#define FRAME_MS 16                             //Draw at most one frame this often while keys keep coming
+#endif
+#define STATUS_TIMEOUT 5                        //Seconds a status message stays up
+#ifndef SAVE_FSYNC
+#define SAVE_FSYNC 1                            //Unless $EDITOR_FSYNC says otherwise: 0 leaves flushing to the kernel, 1 fsyncs the file before it replaces the old one, 2 also fsyncs the directory
+#endif
+#define SAVE_IOV 512                            //Pieces handed to one writev()
+#define THEME_FILE ".editortheme"               //Read from $HOME unless $EDITOR_THEME names another file
+#define THEME_SGR_MAX 48                        //Longest escape a highlight class can compile to
+#define CELL_GLYPH 32                           //Bytes a screen cell has for a character that isn't ASCII, its length first
+#ifndef LONG_LINE_MIN
+#define LONG_LINE_MIN (1 << 20)                 //Rows at least this long are only rendered around the screen
+#endif
+#define LONG_LINE_MARGIN 4096                   //Columns rendered on either side of the screen for those
+#define LONG_LINE_CHUNK (1 << 16)               //Bytes between lexer checkpoints inside a long row
+#define ROW_CLASS_MIN 16                        //Smallest block of row memory, headers included
+#define ROW_CLASSES 9                           //Size classes double from ROW_CLASS_MIN, bigger blocks come from malloc
+#define ROW_SLAB_SIZE (1 << 20)                 //Small blocks are carved out of slabs this big
 
 enum editorKey 
 {
@@ -35,7 +77,8 @@ enum editorKey
   PAGE_DOWN,
   HOME_KEY,
   END_KEY,
-  DEL_KEY
+  DEL_KEY,
+  PASTE_START                                   //Bracketed paste, the text follows up to "\x1b[201~"
 };
 
 enum editorHighlight 
@@ -50,50 +93,314 @@ enum editorHighlight
   HL_MATCH
 };
 
+#define HL_CLASSES (HL_MATCH + 1)
+
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
+#define HL_CHECKPOINT_LINES 128
+#define KEYWORD_TABLE_GROWTH 6                  //Times the keyword table may double looking for a perfect hash
  
 /***DATA***/
 
 //Structure definition
 
+struct keywordEntry
+{
+  const char *word;
+  int len;
+  int hl;
+};
+
+//Perfect hash over a syntax's keywords: every keyword owns a slot, so a lookup is one probe
+struct keywordTable
+{
+  struct keywordEntry *slots;
+  unsigned int mask;
+  unsigned int seed;
+  int minlen;
+  int maxlen;
+};
+
 struct editorSyntax 
 {
   char *filetype;
   char **filematch;
+  char **keywords;                                //Keywords ending in '|' are types (HL_KEYWORD2)
   char *singleline_comment_start;
-  char **keywords;
   char *multiline_comment_start;
   char *multiline_comment_end;
   int flags;
+  struct keywordTable *keywordTable;              //Built from keywords when the syntax is first used
+  struct syntaxDFA *dfa;                          //Compiled lexer, NULL to use the reference loop
+  int compiled;
+};
+
+#define ROW_MAPPED (1<<0)                       //chars points into E.map and is not ours
+#define ROW_HL_VALID (1<<1)                     //hl matches render for the start state in ROW_HL_IN
+#define ROW_HL_IN (1<<2)                        //Row starts inside a multiline comment
+#define ROW_HL_OUT (1<<3)                       //Row ends inside a multiline comment
+#define ROW_DIRTY (1<<4)                        //chars changed since the file was last saved
+#define ROW_UNICODE (1<<5)                      //chars has characters that are not ASCII
+
+//Bytes render has in place of a character that isn't ASCII, one per column
+#define RENDER_GLYPH ((char)0x80)               //Its first column, what to draw comes from chars
+#define RENDER_WIDE ((char)0x81)                //The second column of a wide character
+
+//A character that isn't one byte in one column: a tab, or one that isn't ASCII
+struct wideChar
+{
+  int cx;                                       //Where it starts in chars
+  int rx;                                       //and in render
+  unsigned short len;                           //Bytes in chars
+  unsigned short width;                         //Columns in render
+};
+
+//Where a character of a long row starts and its column
+struct wideChunk
+{
+  int cx;
+  int rx;
+};
+
+/*
+ Rows of at least LONG_LINE_MIN bytes keep render and hl only for a window of
+ columns around E.coloff. Highlighting the window starts from the lexer state
+ at its first byte, which comes from checkpoints taken every LONG_LINE_CHUNK
+ bytes of chars; an edit drops the checkpoints after it. Columns are found the
+ same way, walking the characters from the nearest chunk, and only those of
+ the window are listed.
+*/
+struct rowWindow
+{
+  int rstart;                                   //Column of render[0]
+  int rcx;                                      //Index in chars of render[0]
+  int rend;                                     //Index in chars just past the end of render
+  int hlstart;                                  //Column of hl[0]
+  int *lex;                                     //Lexer state at the start of every chunk
+  int lexValid;                                 //Number of leading checkpoints that are up to date
+  int lexCap;
+  int lexIn;                                    //Comment state the row started in for them
+  const struct syntaxDFA *lexDfa;               //Lexer they were computed with
+  struct wideChunk *chunk;                      //First character at or after the start of every chunk
+  int chunkValid;                               //Number of leading entries that are up to date
+  int chunkCap;
+  int wideValid;                                //The row's wide list holds those of the window
+};
+
+//What only some rows need: their wide characters and, for long rows, the window
+struct rowExtra
+{
+  struct rowWindow *win;                        //Render and hl then cover a window, NULL for other rows
+  int nwide;
+  int cap;                                      //Room in wide
+  struct wideChar wide[];                       //Every wide character in order, built with render; for long rows those of the window
 };
 
+/*
+ A highlight is stored as runs of one class, each an unsigned int holding the
+ column just past its end above the low HL_RUN_BITS bits and the class below.
+ A row shorter than LONG_LINE_MIN renders to fewer than LONG_LINE_MIN * TAB_STOP
+ columns and a long row only highlights its window, so the ends have to fit in
+ the 32 - HL_RUN_BITS bits left.
+*/
+#define HL_RUN_BITS 8
+#if LONG_LINE_MIN * TAB_STOP > (1 << (32 - HL_RUN_BITS))
+#error "LONG_LINE_MIN * TAB_STOP columns do not fit in a highlight run"
+#endif
+#define HL_RUN_END(r) ((int)((r) >> HL_RUN_BITS))
+#define HL_RUN_CLASS(r) ((r) & ((1 << HL_RUN_BITS) - 1))
+
 typedef struct erow 
 {
-  int idx;
   int size;
-  char *chars;
   int rsize;
-  char *render;
-  unsigned char *hl;
-  int hl_open_comment;
+  char *chars;
+  char *render;                                   //chars itself when there is nothing to expand
+  unsigned int *hl;                               //Last highlight snapshot as runs, may be older than render
+  struct rowExtra *x;                             //NULL for ASCII rows without tabs that are not long
+  int hlruns;
+  unsigned int flags : 8;
+  unsigned int gen : 24;                          //Bumped every time chars change
+  int slot;                                       //Where it is in E.row
 } erow;
 
+/*
+ The query is preprocessed once per keystroke: a Horspool shift table for the
+ scalar search, and the SIMD kernels filter on its first and last byte before
+ comparing the rest.
+*/
+struct finder
+{
+  char *q;
+  size_t len;
+  size_t shift[256];
+};
+
+struct matchPos
+{
+  int row;
+  int cx;
+  int len;
+};
+
+enum undoOp
+{
+  UNDO_INSERT = 0,
+  UNDO_DELETE,
+  UNDO_ADDROW                                   //An empty row was added at the end of the file
+};
+
+#define UNDO_JOIN (1<<0)                        //Undone together with the record before it
+#define UNDO_BACKWARD (1<<1)                    //Deleted by backspace, text is stored last byte first
+
+struct undoRec
+{
+  unsigned char op;
+  unsigned char flags;
+  int row;
+  int col;
+  int cy, cx;                                   //Cursor before the edit
+  size_t off;                                   //Text in the arena
+  size_t len;
+};
+
+//Row memory: free lists per size class, the slab being carved, and counters for Ctrl-D
+struct rowMem
+{
+  void *freeList[ROW_CLASSES];
+  char *slab;
+  size_t slabLeft;
+  size_t slabBytes;                             //Memory taken for slabs
+  size_t bigBytes;                              //... and for blocks too big for a class
+  size_t used;                                  //Bytes in blocks handed out
+  unsigned long allocs;
+  unsigned long frees;
+  unsigned long grows;                          //Blocks that had to move to grow
+  unsigned long fits;                           //Growth absorbed by slack
+};
+
+//Where a row that was edited sits in the file on disk
+struct rowOrigin
+{
+  int row;
+  int size;
+  size_t off;
+};
+
+/*
+ Screen frame, drawn and diffed by the OUTPUT section. Each cell has a character,
+ a highlight class and attribute bits; the theme turns a class into colors.
+*/
+#define CELL_REVERSE (1<<0)
+
+//A screen of cells, one plane per property so that spans are copied and filled in bulk
+struct grid
+{
+  char *ch;                                     //ASCII, or RENDER_GLYPH and RENDER_WIDE for other characters
+  unsigned char *hl;                            //Highlight class, picks the color
+  unsigned char *attr;
+  char *glyph;                                  //CELL_GLYPH bytes a cell, the UTF-8 of RENDER_GLYPH cells
+};
+
+#define THEME_DEFAULT -1                        //The terminal's own foreground
+#define THEME_RGB (1 << 24)                     //Flag on 0xRRGGBB colors, others are palette indexes
+
+//How one highlight class looks
+struct themeStyle
+{
+  int color;
+  int bold;
+  int italic;
+};
+
 struct editorConfig
 {
  int cx,cy;
  int screenRows;
  int screenCols;
  int numRows;
- erow *row;
+ uint64_t *row;             //Rows are kept in a gap buffer: [0,gapStart) gap [gapStart+gap,rowCap)
+ int rowCap;
+ int gapStart;
  int rowoff;
  int coloff;
  int rx;
  int dirty;
  char *filename;
+ char *map;                 //Contents of the opened file: a read-only mapping or a heap copy
+ size_t mapSize;
+ int mapHeap;               //map was read into the heap rather than mapped
+ int mapCR;                 //Some line in map ends in \r\n
+ int inPlace;               //The file on disk is laid out like map, so edits that keep row lengths can be patched in
+ int rowsMoved;             //Rows were inserted or deleted since then
+ struct stat diskStat;      //The file on disk when it was loaded or last patched
+ int saveFsync;             //SAVE_FSYNC or $EDITOR_FSYNC
+ struct rowOrigin *origins; //Every row edited since loading, in the order they were first changed
+ int originCount;
+ int originCap;
  char statusmsg[80];
  time_t statusmsg_time;
  struct editorSyntax *syntax;
+ unsigned char *hlCheck;    //Comment state at the start of every HL_CHECKPOINT_LINES-th line
+ int hlCheckCap;
+ int hlCheckValid;          //Number of leading checkpoints that are up to date
+ unsigned long hlVersion;   //Bumped when rows are inserted/deleted or the syntax changes
+ pthread_mutex_t lock;      //Held by the main thread except while it waits for a key
+ pthread_cond_t hlCond;     //Wakes the highlighter when a new frame was drawn
+ unsigned long hlRequest;
+ int hlTop;                 //Rows the last frame showed, highlighted first
+ int hlRows;
+ int hlPipe[2];             //The highlighter writes here when a new snapshot is ready
+ int winchPipe[2];          //... and the SIGWINCH handler here
+ int frameDue;              //Something changed since the last frame was drawn
+ int statusShown;           //The last frame showed the status message
+ char inBuf[INPUT_BUF_SIZE]; //Bytes read from the terminal but not parsed yet
+ size_t inHead;             //Next byte to parse, both counters grow freely and are masked
+ size_t inTail;
+ struct grid frame;         //The frame being drawn and the last one sent to the terminal
+ struct grid shadow;
+ int frameRows;
+ int frameCols;
+ int shadowValid;
+ int shadowRowoff;          //View the shadow was drawn at, to detect scrolling
+ int shadowColoff;
+ int termHl;                //Color and attributes the terminal is currently set to
+ int termAttr;
+ int termCy;                //Where the cursor was left
+ int termCx;
+ unsigned long outBytes;    //Bytes sent to the terminal
+ unsigned long keyBytes;    //... since the last key
+ unsigned long lastKeyBytes;
+ unsigned long keys;
+ int debug;                 //Show output statistics in the message bar
+ int findRow;               //Current search match, drawn over the row's own highlighting
+ int findRx;
+ int findLen;
+ struct finder finder;      //Last search query, kept for Ctrl-N/Ctrl-P
+ int findRegex;             //The query is a regular expression
+ struct regex *regex;       //... compiled, NULL if it isn't valid
+ struct reCache *reCache;   //Matching state for the main thread
+ struct matchPos *matches;  //Every match of the query in file order
+ int matchCount;
+ int matchCap;
+ int matchValid;            //matches is complete and kept up to date by row edits
+ int matchFrom, matchTo;    //Rows edited since matches was brought up to date, matchFrom -1 if none
+ int matchShift;            //... and how far the rows after them moved
+ int matchCur;              //Match at findRow, -1 if none
+ struct undoRec *undo;      //Undo journal, the text of every record is in undoText
+ int undoCount;             //Records, including undone ones that can still be redone
+ int undoPos;               //Records currently applied
+ int undoCap;
+ char *undoText;
+ size_t undoTextLen;
+ size_t undoTextCap;
+ int undoSealed;            //The next edit starts a new record
+ int undoSaved;             //undoPos when the file was saved, -1 once edits have gone another way
+ struct rowMem rowMem;      //Where chars, render and hl come from
+ int termColors;            //Colors the terminal can show: 8, 256 or 1 << 24
+ struct themeStyle theme[HL_CLASSES];
+ char themeSgr[HL_CLASSES][THEME_SGR_MAX]; //Escape that switches to each class, built when the theme is loaded
+ int themeSgrLen[HL_CLASSES];
  struct termios orig_termios;
 };
 
@@ -115,7 +422,8 @@ struct editorSyntax HLDB[] = {
     C_HL_extensions,
     C_HL_keywords,
     "//","/*","*/",
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+    NULL, NULL, 0
   },
 };
 
@@ -123,9 +431,33 @@ struct editorSyntax HLDB[] = {
 
 /*** prototypes ***/
 
+erow *editorRowAt(int at);
+erow *editorRowPeek(int at);
+char *editorLineAt(int at, int *size);
+int editorRowIndex(erow *row);
+void editorRowRender(erow *row);
+void editorRowIndexWide(erow *row);
+struct rowWindow *editorRowWin(erow *row);
+void *rowAlloc(size_t n);
+void *rowGrow(void *p, size_t n);
+void *rowReuse(void *p, size_t n);
+void rowFree(void *p);
+int editorRowLexReady(erow *row, int in, int cx);
+void editorRowLexAdvance(erow *row, int in);
+int editorRowLexState(erow *row, int in, int cx);
+void editorRowMakeLong(erow *row);
+int editorHighlightCatchUp(int filerow, int in, int cx);
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorHandleResize();
+void editorMatchesEdit(int at, int rows);
+struct regex *reCompile(const char *pattern);
+void reFree(struct regex *re);
+struct reCache *reCacheNew(struct regex *re);
+void reCacheFree(struct reCache *c);
+int reSearch(struct regex *re, struct reCache *c, const char *s, int len, int from, int *mlen);
+struct finder *rePrefix(struct regex *re);
 
 /***TERMINAL***/
 
@@ -140,6 +472,7 @@ void die(const char *s)
 
 void disableRawMode() 
 {
+  write(STDOUT_FILENO, "\x1b[?2004l\x1b[0m", 12);            //Bracketed paste off, colors back to normal
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
     die("tcsetattr");
 }
@@ -173,51 +506,155 @@ void enableRawMode()
   */
   raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);             //Local flags   
   
-  //Adding some timeout for read() 
+  //read() never blocks, waiting is done with poll()
   raw.c_cc[VMIN] = 0;                               //Min number of bytes required for read() to return (here it is 0)
-  raw.c_cc[VTIME] = 1;                              //Time it can wait before returning (in 1/10th of a second) 
+  raw.c_cc[VTIME] = 0;                              //Time it can wait before returning (in 1/10th of a second) 
  
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
      {
       die("tcsetattr");
      }
+  //Have the terminal bracket pasted text so it can be inserted in one go
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
-/*Function to get the input from the user one char at a time*/
-int  editorReadKey()                          
+/*
+ Wait up to timeout ms (-1 for ever) for input. Resizes and new
+ highlighting snapshots that come in meanwhile are taken care of and set
+ E.frameDue; drawing is left to the caller. Called without E.lock.
+*/
+int editorWaitEvents(int timeout)
 {
- int bytesRead;
- char c;
- while((bytesRead=read(STDIN_FILENO,&c,1))!=1)
+  struct pollfd fds[3] = {{STDIN_FILENO, POLLIN, 0}, {E.hlPipe[0], POLLIN, 0}, {E.winchPipe[0], POLLIN, 0}};
+  if (poll(fds, 3, timeout) == -1)
   {
-   if(bytesRead==-1 && errno !=EAGAIN )
-     {
-        die("read");
-     }
+    if (errno == EINTR)
+      return 0;
+    die("poll");
+  }
+  char drain[64];
+  if (fds[1].revents & POLLIN)
+  {
+    while (read(E.hlPipe[0], drain, sizeof(drain)) > 0)
+      ;
+    pthread_mutex_lock(&E.lock);
+    E.frameDue = 1;
+    pthread_mutex_unlock(&E.lock);
+  }
+  if (fds[2].revents & POLLIN)
+  {
+    while (read(E.winchPipe[0], drain, sizeof(drain)) > 0)
+      ;
+    pthread_mutex_lock(&E.lock);
+    editorHandleResize();
+    E.frameDue = 1;
+    pthread_mutex_unlock(&E.lock);
+  }
+  return fds[0].revents != 0;
+}
+
+/*
+ Wait for a key outside the main loop (in a prompt, or in the middle of an
+ escape sequence), repainting right away when something else changed.
+*/
+void editorWaitInput()
+{
+  while (!editorWaitEvents(-1))
+  {
+    pthread_mutex_lock(&E.lock);
+    if (E.frameDue)
+      editorRefreshScreen();
+    pthread_mutex_unlock(&E.lock);
+  }
+}
+
+/*
+ Terminal input goes through a ring buffer. Whatever the terminal has is
+ taken with one read(), so a burst of keys (key repeat, fast typing over a
+ slow link, a paste) costs one system call and is then parsed out of
+ memory.
+*/
+
+//Read what the terminal has, waiting up to timeout ms (-1 for ever) for it
+int editorFillInput(int timeout)
+{
+  size_t space = INPUT_BUF_SIZE - (E.inTail - E.inHead);
+  if (space == 0)
+    return 1;
+  struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+  int ready;
+  while ((ready = poll(&fd, 1, timeout)) == -1)
+  {
+    if (errno != EINTR)
+      die("poll");
   }
+  if (ready == 0)
+    return 0;
+  size_t at = E.inTail & (INPUT_BUF_SIZE - 1);
+  size_t n = INPUT_BUF_SIZE - at;
+  if (n > space)
+    n = space;
+  ssize_t got = read(STDIN_FILENO, &E.inBuf[at], n);
+  if (got == -1)
+  {
+    if (errno == EAGAIN || errno == EINTR)
+      return 0;
+    die("read");
+  }
+  E.inTail += got;
+  return got > 0;
+}
+
+int editorReadByte(char *c, int timeout)
+{
+  if (E.inHead == E.inTail && !editorFillInput(timeout))
+    return 0;
+  *c = E.inBuf[E.inHead++ & (INPUT_BUF_SIZE - 1)];
+  return 1;
+}
+
+//Whether a key can be read without waiting
+int editorInputPending()
+{
+  return E.inHead != E.inTail || editorFillInput(0);
+}
+
+/*Function to get the input from the user one char at a time*/
+int  editorReadKeyUnlocked()                          
+{
+ char c;
+ while (!editorReadByte(&c, 0))
+   editorWaitInput();
   if (c == '\x1b')
    {
     char seq[3];
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) 
+    if (!editorReadByte(&seq[0], ESC_TIMEOUT_MS)) 
            return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) 
+    if (!editorReadByte(&seq[1], ESC_TIMEOUT_MS)) 
            return '\x1b';
     if (seq[0] == '[') 
     {
       if (seq[1] >= '0' && seq[1] <= '9')
        {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) 
-          return '\x1b';
+        int num = seq[1] - '0';
+        do
+        {
+          if (!editorReadByte(&seq[2], ESC_TIMEOUT_MS)) 
+            return '\x1b';
+          if (seq[2] >= '0' && seq[2] <= '9')
+            num = num * 10 + seq[2] - '0';
+        } while (seq[2] >= '0' && seq[2] <= '9' && num < 1000);
         if (seq[2] == '~')
           {
-           switch (seq[1]) 
+           switch (num) 
            {
-            case '1': return HOME_KEY;
-            case '3': return DEL_KEY;
-	    case '4': return END_KEY;
-            case '5': return PAGE_UP;
-            case '6': return PAGE_DOWN;
-            case '7': return HOME_KEY;
-            case '8': return END_KEY;
+            case 1: return HOME_KEY;
+            case 3: return DEL_KEY;
+	    case 4: return END_KEY;
+            case 5: return PAGE_UP;
+            case 6: return PAGE_DOWN;
+            case 7: return HOME_KEY;
+            case 8: return END_KEY;
+            case 200: return PASTE_START;
            }
         }
       }
@@ -251,6 +688,77 @@ int  editorReadKey()
   }
 }
 
+//The editor state is left to the highlighter while we wait for a key
+int editorReadKey()
+{
+  pthread_mutex_unlock(&E.lock);
+  int c = editorReadKeyUnlocked();
+  pthread_mutex_lock(&E.lock);
+  return c;
+}
+
+/*
+ Read the text of a bracketed paste after editorReadKey returned
+ PASTE_START. The terminal sends it all at once, so it is read in large
+ chunks up to the closing "\x1b[201~"; anything after that is left for
+ editorReadKey. Line ends come in as '\r' and are turned into '\n'.
+*/
+char *editorReadPaste(size_t *len)
+{
+  size_t cap = 1 << 16;
+  size_t n = 0;
+  size_t scanned = 0;
+  char *buf = malloc(cap);
+  if (buf == NULL)
+    die("malloc");
+  pthread_mutex_unlock(&E.lock);
+  while (1)
+  {
+    if (E.inHead == E.inTail && !editorFillInput(PASTE_TIMEOUT_MS))
+      break;
+    size_t at = E.inHead & (INPUT_BUF_SIZE - 1);
+    size_t take = E.inTail - E.inHead;
+    if (take > INPUT_BUF_SIZE - at)
+      take = INPUT_BUF_SIZE - at;
+    if (cap - n < take)
+    {
+      while (cap - n < take)
+        cap *= 2;
+      buf = realloc(buf, cap);
+      if (buf == NULL)
+        die("realloc");
+    }
+    memcpy(&buf[n], &E.inBuf[at], take);
+    E.inHead += take;
+    n += take;
+    char *end = memmem(&buf[scanned], n - scanned, "\x1b[201~", 6);
+    if (end != NULL)
+    {
+      //What follows the paste is still in the ring, put it back
+      E.inHead -= n - (end + 6 - buf);
+      n = end - buf;
+      break;
+    }
+    scanned = n > 5 ? n - 5 : 0;
+  }
+  pthread_mutex_lock(&E.lock);
+
+  size_t out = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    if (buf[i] == '\r')
+    {
+      buf[out++] = '\n';
+      if (i + 1 < n && buf[i + 1] == '\n')
+        i++;
+    }
+    else
+      buf[out++] = buf[i];
+  }
+  *len = out;
+  return buf;
+}
+
 int getCursorPosition(int *rows, int *cols)
 {
   char buf[32];
@@ -262,7 +770,7 @@ int getCursorPosition(int *rows, int *cols)
  // printf("\r\n");
   while (i < sizeof(buf) - 1) 
   {
-    if (read(STDIN_FILENO, &buf[i], 1) != 1)
+    if (!editorReadByte(&buf[i], ESC_TIMEOUT_MS))
     {
      break;
     }
@@ -308,45 +816,188 @@ int getWindowSize( int *rows , int *cols)
     }
 }
 
+//The terminal was resized, the next frame is drawn from scratch at the new size
+void editorHandleResize()
+{
+  if (getWindowSize(&E.screenRows, &E.screenCols) == -1)
+    die("getWindowSize");
+  E.screenRows -= 2;
+  if (E.screenRows < 1)
+    E.screenRows = 1;
+  E.shadowValid = 0;
+}
+
+void editorSigwinch(int sig)
+{
+  (void)sig;
+  int saved = errno;
+  write(E.winchPipe[1], "w", 1);                              //Fails only if one is already pending
+  errno = saved;
+}
+
+void editorWatchResize()
+{
+  if (pipe(E.winchPipe) == -1)
+    die("pipe");
+  fcntl(E.winchPipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(E.winchPipe[1], F_SETFL, O_NONBLOCK);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = editorSigwinch;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  if (sigaction(SIGWINCH, &sa, NULL) == -1)
+    die("sigaction");
+}
+
 /*** syntax highlighting ***/
 
 int is_separator(int c) 
 {
+  if (c < 0 || c > 0x7f)                        //Bytes of UTF-8 characters are part of words
+    return 0;
   return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-void editorUpdateSyntax(erow *row) 
+unsigned int keywordHash(unsigned int seed, const char *s, int len)
 {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
-  if (E.syntax == NULL) 
-    return;
-  char *scs = E.syntax->singleline_comment_start;
-  char *mcs = E.syntax->multiline_comment_start;
-  char *mce = E.syntax->multiline_comment_end;
+  unsigned int h = seed ^ 2166136261u;
+  int i;
+  for (i = 0; i < len; i++)
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  return h ^ (h >> 15);
+}
+
+/*
+ Put the keywords in kt->slots with kt->seed. Empty keywords are skipped and a
+ keyword equal to one already placed is dropped, the first one wins as it did
+ in the list. Returns 0 if two different keywords want the same slot; with
+ 'force' the later one is dropped instead.
+*/
+int keywordPlace(struct keywordTable *kt, char **keywords, int n, int force)
+{
+  int j;
+  memset(kt->slots, 0, (kt->mask + 1) * sizeof(struct keywordEntry));
+  kt->minlen = 1 << 30;
+  kt->maxlen = 0;
+  for (j = 0; j < n; j++)
+  {
+    int len = strlen(keywords[j]);
+    int kw2 = len > 0 && keywords[j][len - 1] == '|';
+    if (kw2)
+      len--;
+    if (len == 0)
+      continue;
+    struct keywordEntry *e = &kt->slots[keywordHash(kt->seed, keywords[j], len) & kt->mask];
+    if (e->word)
+    {
+      if ((e->len == len && !memcmp(e->word, keywords[j], len)) || force)
+        continue;
+      return 0;
+    }
+    e->word = keywords[j];
+    e->len = len;
+    e->hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+    if (len < kt->minlen)
+      kt->minlen = len;
+    if (len > kt->maxlen)
+      kt->maxlen = len;
+  }
+  return 1;
+}
+
+/*
+ Find a seed for which no two keywords share a slot, starting with twice as
+ many slots as keywords and doubling that if no seed works. Distinct keywords
+ always fit long before KEYWORD_TABLE_GROWTH doublings; should they not, the
+ table is kept with the keywords that collided left out.
+*/
+struct keywordTable *editorCompileKeywords(char **keywords)
+{
+  struct keywordTable *kt = calloc(1, sizeof(struct keywordTable));
+  if (kt == NULL)
+    die("calloc");
+  int n = 0, grown;
+  while (keywords && keywords[n])
+    n++;
+  unsigned int size = 4;
+  while (size < 2u * n)
+    size *= 2;
+  for (grown = 0; ; grown++)
+  {
+    kt->slots = calloc(size, sizeof(struct keywordEntry));
+    if (kt->slots == NULL)
+      die("calloc");
+    kt->mask = size - 1;
+    for (kt->seed = 1; kt->seed <= 1000; kt->seed++)
+      if (keywordPlace(kt, keywords, n, 0))
+        return kt;
+    if (grown == KEYWORD_TABLE_GROWTH)
+      break;
+    free(kt->slots);
+    size *= 2;
+  }
+  kt->seed = 1;
+  keywordPlace(kt, keywords, n, 1);
+  return kt;
+}
+
+//Keyword class of s[0..len) or HL_NORMAL
+int editorKeywordLookup(struct keywordTable *kt, const char *s, int len)
+{
+  if (kt == NULL || len < kt->minlen || len > kt->maxlen)
+    return HL_NORMAL;
+  struct keywordEntry *e = &kt->slots[keywordHash(kt->seed, s, len) & kt->mask];
+  if (e->word && e->len == len && !memcmp(e->word, s, len))
+    return e->hl;
+  return HL_NORMAL;
+}
+
+/*
+ Highlight one line. 'in_comment' is the multiline comment state at the start
+ of the line and the state at its end is returned. With hl == NULL only that
+ state is computed, which is what the checkpoint scan below uses: tabs do not
+ change the state and UTF-8 bytes lex like the RENDER_GLYPH bytes render has
+ for them, so chars can be scanned without rendering the row.
+
+ This is the reference implementation; editorHighlightLine normally runs the
+ DFA compiled from the same rules below and falls back to this one.
+*/
+int editorHighlightLineRef(struct editorSyntax *syntax, const char *s, int len, unsigned char *hl, int in_comment)
+{
+  if (hl)
+    memset(hl, HL_NORMAL, len);
+  if (syntax == NULL) 
+    return 0;
+  char *scs = syntax->singleline_comment_start;
+  char *mcs = syntax->multiline_comment_start;
+  char *mce = syntax->multiline_comment_end;
   int scs_len = scs ? strlen(scs) : 0;
   int mcs_len = mcs ? strlen(mcs) : 0;
   int mce_len = mce ? strlen(mce) : 0;
   int prev_sep = 1;
   int in_string = 0;
-  int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+  unsigned char prev_hl = HL_NORMAL;
   int i = 0;
 
-  while (i < row->rsize) 
+  while (i < len) 
   {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+    char c = s[i];
     if (scs_len && !in_string && !in_comment) {
-      if (!strncmp(&row->render[i], scs, scs_len)) {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+      if (len - i >= scs_len && !strncmp(&s[i], scs, scs_len)) {
+        if (hl)
+          memset(&hl[i], HL_COMMENT, len - i);
         break;
       }
     }
     if (mcs_len && mce_len && !in_string) {
       if (in_comment) {
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(&row->render[i], mce, mce_len)) {
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+        prev_hl = HL_MLCOMMENT;
+        if (hl)
+          hl[i] = HL_MLCOMMENT;
+        if (len - i >= mce_len && !strncmp(&s[i], mce, mce_len)) {
+          if (hl)
+            memset(&hl[i], HL_MLCOMMENT, mce_len);
           i += mce_len;
           in_comment = 0;
           prev_sep = 1;
@@ -355,18 +1006,23 @@ void editorUpdateSyntax(erow *row)
           i++;
           continue;
         }
-      } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+      } else if (len - i >= mcs_len && !strncmp(&s[i], mcs, mcs_len)) {
+        if (hl)
+          memset(&hl[i], HL_MLCOMMENT, mcs_len);
+        prev_hl = HL_MLCOMMENT;
         i += mcs_len;
         in_comment = 1;
         continue;
       }
     }
-    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+    if (syntax->flags & HL_HIGHLIGHT_STRINGS) {
       if (in_string) {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i + 1 < row->rsize) {
-          row->hl[i + 1] = HL_STRING;
+        prev_hl = HL_STRING;
+        if (hl)
+          hl[i] = HL_STRING;
+        if (c == '\\' && i + 1 < len) {
+          if (hl)
+            hl[i + 1] = HL_STRING;
           i += 2;
           continue;
         }
@@ -377,481 +1033,5120 @@ void editorUpdateSyntax(erow *row)
       } else {
         if (c == '"' || c == '\'') {
           in_string = c;
-          row->hl[i] = HL_STRING;
+          prev_hl = HL_STRING;
+          if (hl)
+            hl[i] = HL_STRING;
           i++;
           continue;
         }
       }
     }
-    if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
+    if (syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+      if ((isdigit((unsigned char)c) && (prev_sep || prev_hl == HL_NUMBER)) ||
           (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
+        prev_hl = HL_NUMBER;
+        if (hl)
+          hl[i] = HL_NUMBER;
         i++;
         prev_sep = 0;
         continue;
       }
     }
+    //Keywords only change colors, a state-only scan can skip them
+    if (prev_sep && hl) {
+      int klen = 0;
+      while (i + klen < len && !is_separator((unsigned char)s[i + klen]))
+        klen++;
+      int kw = editorKeywordLookup(syntax->keywordTable, &s[i], klen);
+      if (kw != HL_NORMAL) {
+        memset(&hl[i], kw, klen);
+        prev_hl = kw;
+        i += klen;
+        prev_sep = 0;
+        continue;
+      }
+    }
+    prev_hl = HL_NORMAL;
     prev_sep = is_separator(c);
     i++;
   }
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if (changed && row->idx + 1 < E.numRows)
-    editorUpdateSyntax(&E.row[row->idx + 1]);
+  return in_comment;
 }
 
-int editorSyntaxToColor(int hl) 
+/*
+ The rules above, compiled into a DFA over byte classes when a syntax is
+ first selected. Comment delimiters can need a few bytes of lookahead
+ ("/" could start either comment in C), so a DFA state is the lexer state plus the
+ bytes that are still undecided, and a transition can decide several bytes
+ at once. Every decided byte comes with its class, whether it is a separator
+ and whether a keyword candidate starts there; keywords themselves are
+ looked up in the keyword table when the run ends.
+
+ The DFA is built by running the same decisions editorHighlightLineRef makes
+ on every reachable state, so both produce the same result.
+*/
+#define DFA_MAX_PENDING 8                       //Longest comment delimiter the DFA handles
+#define DFA_MAX_STATES 512
+#define DFA_SEP 0x10                            //Decided byte is a separator
+#define DFA_KWSTART 0x20                        //A keyword candidate starts at this byte
+#define DFA_HL_MASK 0x0f
+
+enum lexMode
 {
-  switch (hl) 
-  {
-    case HL_NUMBER: 
-        return 31;
-    case HL_MATCH:
-        return 34;
-    case HL_STRING:
-        return 35;
-    case HL_COMMENT:
-    case HL_MLCOMMENT:
-        return 36;
-    case HL_KEYWORD1: 
-        return 33;
-    case HL_KEYWORD2: 
-        return 32;
-    default:
-        return 37;
-  }
+  LEX_NORMAL = 0,
+  LEX_STRING,
+  LEX_ESCAPE,                                   //The byte after a backslash in a string
+  LEX_MLCOMMENT,
+  LEX_COMMENT                                   //Rest of the line is a comment
+};
+
+struct lexState
+{
+  unsigned char mode;
+  unsigned char quote;
+  unsigned char sep;                            //Previous byte was a separator
+  unsigned char num;                            //Previous byte was part of a number
+  unsigned char npend;
+  unsigned char pend[DFA_MAX_PENDING];
+};
+
+struct dfaTrans
+{
+  unsigned short next;
+  unsigned char n;                              //Number of bytes decided by this transition
+  unsigned char emit[DFA_MAX_PENDING];
+};
+
+struct syntaxDFA
+{
+  unsigned char cls[256];                       //Byte to byte class
+  int nclass;
+  int nstates;
+  int start;
+  int startComment;
+  struct dfaTrans *trans;                       //nstates * nclass
+  struct dfaTrans *flush;                       //Per state, what is decided at the end of a line
+  unsigned char *endComment;                    //Per state, line ends inside a multiline comment
+};
+
+//1: pending bytes start with delim, -1: they are a proper prefix of it, 0: no match
+int lexMatch(struct lexState *st, const char *delim, int dlen)
+{
+  int n = st->npend < dlen ? st->npend : dlen;
+  if (memcmp(st->pend, delim, n))
+    return 0;
+  return st->npend >= dlen ? 1 : -1;
 }
 
-void editorSelectSyntaxHighlight() 
+int lexEmit(unsigned char *out, int n, int hl, int c)
 {
-  E.syntax = NULL;
-  if (E.filename == NULL) 
-     return;
-  char *ext = strrchr(E.filename, '.');
-  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) 
+  int j;
+  for (j = 0; j < n; j++)
+    out[j] = hl | (is_separator((char)c) ? DFA_SEP : 0);
+  return n;
+}
+
+/*
+ Decide the first pending byte(s) the way editorHighlightLineRef does.
+ Returns how many bytes were decided, 0 when more input is needed.
+*/
+int lexDecide(struct editorSyntax *syntax, struct lexState *st, int final, unsigned char *out)
+{
+  char *scs = syntax->singleline_comment_start;
+  char *mcs = syntax->multiline_comment_start;
+  char *mce = syntax->multiline_comment_end;
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+  char c = st->pend[0];
+  int n = 1;
+  int r;
+
+  switch (st->mode)
   {
-    struct editorSyntax *s = &HLDB[j];
-    unsigned int i = 0;
-    while (s->filematch[i])
-     {
-      int is_ext = (s->filematch[i][0] == '.');
-      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-          (!is_ext && strstr(E.filename, s->filematch[i]))) 
+    case LEX_COMMENT:
+      lexEmit(out, 1, HL_COMMENT, c);
+      break;
+    case LEX_ESCAPE:
+      lexEmit(out, 1, HL_STRING, c);
+      st->mode = LEX_STRING;
+      break;
+    case LEX_STRING:
+      lexEmit(out, 1, HL_STRING, c);
+      if (c == '\\')
+        st->mode = LEX_ESCAPE;
+      else if (c == st->quote)
       {
-        E.syntax = s;
-        int filerow;
-        for (filerow = 0; filerow < E.numRows; filerow++) 
+        st->mode = LEX_NORMAL;
+        st->quote = 0;
+        st->sep = 1;
+        st->num = 0;
+      }
+      break;
+    case LEX_MLCOMMENT:
+      r = lexMatch(st, mce, mce_len);
+      if (r == -1 && !final)
+        return 0;
+      if (r == 1)
+      {
+        int j;
+        for (j = 0; j < mce_len; j++)
+          lexEmit(&out[j], 1, HL_MLCOMMENT, st->pend[j]);
+        n = mce_len;
+        st->mode = LEX_NORMAL;
+        st->sep = 1;
+        st->num = 0;
+      }
+      else
+        lexEmit(out, 1, HL_MLCOMMENT, c);
+      break;
+    default:
+      if (scs_len)
+      {
+        r = lexMatch(st, scs, scs_len);
+        if (r == -1 && !final)
+          return 0;
+        if (r == 1)
         {
-          editorUpdateSyntax(&E.row[filerow]);
+          lexEmit(out, 1, HL_COMMENT, c);
+          st->mode = LEX_COMMENT;
+          break;
         }
-        return;
       }
-      i++;
-    }
+      if (mcs_len && mce_len)
+      {
+        r = lexMatch(st, mcs, mcs_len);
+        if (r == -1 && !final)
+          return 0;
+        if (r == 1)
+        {
+          int j;
+          for (j = 0; j < mcs_len; j++)
+            lexEmit(&out[j], 1, HL_MLCOMMENT, st->pend[j]);
+          n = mcs_len;
+          st->mode = LEX_MLCOMMENT;
+          st->sep = 1;
+          st->num = 0;
+          break;
+        }
+      }
+      if ((syntax->flags & HL_HIGHLIGHT_STRINGS) && (c == '"' || c == '\''))
+      {
+        lexEmit(out, 1, HL_STRING, c);
+        st->mode = LEX_STRING;
+        st->quote = c;
+        st->sep = 1;
+        st->num = 0;
+        break;
+      }
+      if ((syntax->flags & HL_HIGHLIGHT_NUMBERS) &&
+          ((isdigit((unsigned char)c) && (st->sep || st->num)) || (c == '.' && st->num)))
+      {
+        lexEmit(out, 1, HL_NUMBER, c);
+        st->sep = 0;
+        st->num = 1;
+        break;
+      }
+      lexEmit(out, 1, HL_NORMAL, c);
+      if (st->sep && !is_separator(c))
+        out[0] |= DFA_KWSTART;
+      st->num = 0;
+      st->sep = is_separator(c);
+      break;
   }
+  st->npend -= n;
+  memmove(st->pend, &st->pend[n], st->npend);
+  memset(&st->pend[st->npend], 0, DFA_MAX_PENDING - st->npend);
+  return n;
 }
 
-/***Row OPERATIONS***/
-
-int editorRowCxToRx(erow *row, int cx) 
+//Feed one byte (or the end of the line when c < 0) and record what gets decided
+void lexStep(struct editorSyntax *syntax, struct lexState *st, int c, struct dfaTrans *t)
 {
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++)
+  int final = c < 0;
+  t->n = 0;
+  if (!final)
+    st->pend[st->npend++] = c;
+  while (st->npend > 0)
   {
-    if (row->chars[j] == '\t')
-      rx += (TAB_STOP - 1) - (rx % TAB_STOP);
-    rx++;
+    int n = lexDecide(syntax, st, final, &t->emit[t->n]);
+    if (n == 0)
+      break;
+    t->n += n;
   }
-  return rx;
 }
 
-int editorRowRxToCx(erow *row, int rx) 
+int lexStateId(struct lexState *states, int *nstates, struct lexState *st)
 {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++) 
-  {
-    if (row->chars[cx] == '\t')
-      cur_rx += (TAB_STOP - 1) - (cur_rx %TAB_STOP);
-    cur_rx++;
-    if (cur_rx > rx) 
-      return cx;
-  }
-  return cx;
+  int j;
+  for (j = 0; j < *nstates; j++)
+    if (!memcmp(&states[j], st, sizeof(struct lexState)))
+      return j;
+  if (*nstates == DFA_MAX_STATES)
+    return -1;
+  states[*nstates] = *st;
+  return (*nstates)++;
 }
 
-void editorUpdateRow(erow *row)                 //Function to take care of tabs in the file 
+//NULL when the syntax needs something the DFA can't express, editorHighlightLineRef is used then
+struct syntaxDFA *editorCompileSyntax(struct editorSyntax *syntax)
 {
-  int tabs=0;
-  int j;
- 
-  for (j = 0; j < row->size; j++)
-    if (row->chars[j] == '\t') 
-     {
-      tabs++;
-     }
-  free(row->render);
-  row->render = malloc(row->size + tabs*(TAB_STOP-1) + 1);
-
-  int idx = 0;
-  for (j = 0; j < row->size; j++) 
+  const char *delims[3] = { syntax->singleline_comment_start,
+    syntax->multiline_comment_start, syntax->multiline_comment_end };
+  unsigned char special[256] = {0};
+  int j, c;
+  for (j = 0; j < 3; j++)
   {
-    if (row->chars[j] == '\t') 
+    if (delims[j] && strlen(delims[j]) > DFA_MAX_PENDING)
+      return NULL;
+    for (c = 0; delims[j] && delims[j][c]; c++)
+      special[(unsigned char)delims[j][c]] = 1;
+  }
+  //Keywords are matched on the raw run of bytes, which must not start strings or comments
+  for (j = 0; syntax->keywords && syntax->keywords[j]; j++)
+    for (c = 0; syntax->keywords[j][c]; c++)
     {
-      row->render[idx++] = ' ';
-      while (idx % TAB_STOP != 0)
-       {
-          row->render[idx++] = ' ';
-       }
+      char k = syntax->keywords[j][c];
+      if (k == '"' || k == '\'')
+        return NULL;
+      for (int d = 0; d < 3; d++)
+        if (delims[d] && delims[d][0] == k && !is_separator(k))
+          return NULL;
     }
-    else
-    {
-    row->render[idx++] = row->chars[j];
-    }
-  } 
-  row->render[idx] = '\0';
-  row->rsize = idx;
-
-  editorUpdateSyntax(row);
-}
-
-void editorInsertRow(int at, char *s, size_t len) 
-{
-  if (at < 0 || at > E.numRows) 
-    return;
-
-  E.row = realloc(E.row, sizeof(erow) * (E.numRows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numRows - at));
-
-  for (int j = at + 1; j <= E.numRows; j++) 
-       E.row[j].idx++;
 
-  E.row[at].idx = at;
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
+  struct syntaxDFA *d = calloc(1, sizeof(struct syntaxDFA));
+  if (d == NULL)
+    die("calloc");
 
-  memcpy(E.row[at].chars, s, len);
+  //Bytes that behave the same share a class
+  int rep[256];
+  int sig[256];
+  d->nclass = 0;
+  for (c = 0; c < 256; c++)
+  {
+    int s = (c == '"' || c == '\'' || c == '\\' || c == '.' || special[c]) ? 256 + c :
+      (is_separator(c) ? 1 : 0) | (isdigit(c) ? 2 : 0);
+    for (j = 0; j < d->nclass; j++)
+      if (sig[j] == s)
+        break;
+    if (j == d->nclass)
+    {
+      sig[j] = s;
+      rep[j] = c;
+      d->nclass++;
+    }
+    d->cls[c] = j;
+  }
 
-  E.row[at].chars[len] = '\0';
-  E.row[at].rsize=0;
-  E.row[at].render=NULL;
-  E.row[at].hl=NULL;
-  E.row[at].hl_open_comment = 0;
+  struct lexState *states = calloc(DFA_MAX_STATES, sizeof(struct lexState));
+  struct dfaTrans *trans = malloc(sizeof(struct dfaTrans) * DFA_MAX_STATES * d->nclass);
+  struct dfaTrans *flush = calloc(DFA_MAX_STATES, sizeof(struct dfaTrans));
+  d->endComment = calloc(DFA_MAX_STATES, 1);
+  if (states == NULL || trans == NULL || flush == NULL || d->endComment == NULL)
+    die("calloc");
 
-  editorUpdateRow(&E.row[at]);
+  int nstates = 0;
+  struct lexState st;
+  memset(&st, 0, sizeof(st));
+  st.mode = LEX_NORMAL;
+  st.sep = 1;
+  d->start = lexStateId(states, &nstates, &st);
+  st.mode = LEX_MLCOMMENT;
+  d->startComment = d->start;
+  if (delims[1] && delims[2] && delims[1][0] && delims[2][0])
+    d->startComment = lexStateId(states, &nstates, &st);
 
-  E.numRows++;
-  E.dirty++;
-  
+  int i;
+  for (i = 0; i < nstates; i++)
+  {
+    for (j = 0; j < d->nclass; j++)
+    {
+      struct lexState next = states[i];
+      struct dfaTrans *t = &trans[i * d->nclass + j];
+      lexStep(syntax, &next, rep[j], t);
+      int id = lexStateId(states, &nstates, &next);
+      if (id < 0)
+      {
+        free(states);
+        free(trans);
+        free(flush);
+        free(d->endComment);
+        free(d);
+        return NULL;
+      }
+      t->next = id;
+    }
+    struct lexState end = states[i];
+    lexStep(syntax, &end, -1, &flush[i]);
+    d->endComment[i] = states[i].mode == LEX_MLCOMMENT;
+  }
+  d->nstates = nstates;
+  d->trans = realloc(trans, sizeof(struct dfaTrans) * nstates * d->nclass);
+  d->flush = flush;
+  free(states);
+  return d;
 }
 
-void editorFreeRow(erow *row) 
+//Apply the bytes a transition decided, closing and looking up keyword runs
+void dfaApply(const struct dfaTrans *t, struct keywordTable *kt, const char *s,
+  unsigned char *hl, int *pos, int *tok)
 {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+  int k;
+  for (k = 0; k < t->n; k++, (*pos)++)
+  {
+    unsigned char e = t->emit[k];
+    hl[*pos] = e & DFA_HL_MASK;
+    if (*tok >= 0 && (e & DFA_SEP))
+    {
+      int kw = editorKeywordLookup(kt, &s[*tok], *pos - *tok);
+      if (kw != HL_NORMAL)
+        memset(&hl[*tok], kw, *pos - *tok);
+      *tok = -1;
+    }
+    if (e & DFA_KWSTART)
+      *tok = *pos;
+  }
 }
 
-void editorDelRow(int at) {
+//Run the lexer over s from state and return the state it ends in
+int editorHighlightDFA(struct editorSyntax *syntax, const char *s, int len, unsigned char *hl, int state)
+{
+  const struct syntaxDFA *d = syntax->dfa;
+  const unsigned char *cls = d->cls;
+  const struct dfaTrans *trans = d->trans;
+  int nclass = d->nclass;
+  int i;
+  if (hl == NULL)
+  {
+    for (i = 0; i < len; i++)
+      state = trans[state * nclass + cls[(unsigned char)s[i]]].next;
+    return state;
+  }
+  int pos = 0, tok = -1;
+  for (i = 0; i < len; i++)
+  {
+    const struct dfaTrans *t = &trans[state * nclass + cls[(unsigned char)s[i]]];
+    state = t->next;
+    if (t->n == 1 && !(t->emit[0] & (tok < 0 ? DFA_KWSTART : DFA_KWSTART | DFA_SEP)))
+      hl[pos++] = t->emit[0] & DFA_HL_MASK;
+    else
+      dfaApply(t, syntax->keywordTable, s, hl, &pos, &tok);
+  }
+  dfaApply(&d->flush[state], syntax->keywordTable, s, hl, &pos, &tok);
+  if (tok >= 0)
+  {
+    int kw = editorKeywordLookup(syntax->keywordTable, &s[tok], len - tok);
+    if (kw != HL_NORMAL)
+      memset(&hl[tok], kw, len - tok);
+  }
+  return state;
+}
 
-  if (at < 0 || at >= E.numRows) 
-    return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numRows - at - 1));
-  for (int j = at; j < E.numRows - 1; j++) 
-    E.row[j].idx--;
-  E.numRows--;
-  E.dirty++;
+int editorHighlightLineDFA(struct editorSyntax *syntax, const char *s, int len, unsigned char *hl, int in_comment)
+{
+  const struct syntaxDFA *d = syntax->dfa;
+  return d->endComment[editorHighlightDFA(syntax, s, len, hl, in_comment ? d->startComment : d->start)];
 }
 
-void editorRowInsertChar(erow *row, int at, int c)                  //Insert characters
+void editorCompileSyntaxOnce(struct editorSyntax *syntax)
 {
-  if (at < 0 || at > row->size)
-     at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  editorUpdateRow(row);
-  E.dirty++;
+  if (syntax->compiled)
+    return;
+  syntax->keywordTable = editorCompileKeywords(syntax->keywords);
+  syntax->dfa = editorCompileSyntax(syntax);
+  syntax->compiled = 1;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) 
+int editorHighlightLine(struct editorSyntax *syntax, const char *s, int len, unsigned char *hl, int in_comment)
 {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+  if (syntax && syntax->dfa)
+    return editorHighlightLineDFA(syntax, s, len, hl, in_comment);
+  return editorHighlightLineRef(syntax, s, len, hl, in_comment);
 }
 
-void editorRowDelChar(erow *row, int at)            //Delete chars
+/*
+ Comment state at the end of a row, reusing its highlight when that is still
+ valid. Long rows go by their lexer checkpoints; without a DFA there are none
+ and the reference lexer cannot stop midway, so they count as ending outside
+ a comment.
+*/
+int editorRowSyntaxOut(erow *row, int in)
 {
- if(at < 0 || at >= row->size)
+  if (editorRowWin(row) || row->size >= LONG_LINE_MIN)
   {
-    return;
+    if (E.syntax == NULL || E.syntax->dfa == NULL)
+      return 0;
+    if (editorRowWin(row) == NULL)
+      editorRowMakeLong(row);
+    return E.syntax->dfa->endComment[editorRowLexState(row, in, row->size)];
   }
- memmove(&row->chars[at], &row->chars[at+1],row->size - at);
- row->size--;
- editorUpdateRow(row);
- E.dirty++;
+  if ((row->flags & ROW_HL_VALID) && !(row->flags & ROW_HL_IN) == !in)
+    return (row->flags & ROW_HL_OUT) != 0;
+  return editorHighlightLine(E.syntax, row->chars, row->size, NULL, in);
 }
 
-/*** editor operations ***/
-void editorInsertChar(int c) 
+/*
+ Highlighting is computed lazily for the rows that are drawn. To know the
+ comment state a row starts in, the state at the start of every
+ HL_CHECKPOINT_LINES-th line is remembered; edits only drop the checkpoints
+ after the edited line and they are rebuilt when a row below is drawn.
+*/
+void editorInvalidateSyntax(int filerow)
 {
-  if (E.cy == E.numRows) 
-  {
-    editorInsertRow(E.numRows, "", 0);
-  }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  E.cx++;
+  int valid = filerow / HL_CHECKPOINT_LINES + 1;
+  if (E.hlCheckValid > valid)
+    E.hlCheckValid = valid;
 }
 
-void editorInsertNewline() 
+/*
+ Comment state at the end of a line for the scans below. The lexer checkpoints
+ of a long row that are behind are caught up first with the lock released
+ between chunks, and -1 returned: rows may have changed meanwhile, so the scan
+ has to start over. The work done is kept and the next try gets further.
+*/
+int editorLineSyntaxOut(int line, int in)
 {
-  if (E.cx == 0) 
-  {
-    editorInsertRow(E.cy, "", 0);
-  }
-  else
+  int size;
+  char *chars = editorLineAt(line, &size);
+  if (editorRowPeek(line) == NULL && size < LONG_LINE_MIN)
+    return editorHighlightLine(E.syntax, chars, size, NULL, in);
+  erow *row = editorRowAt(line);
+  if ((editorRowWin(row) || row->size >= LONG_LINE_MIN) && E.syntax && E.syntax->dfa)
   {
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    if (editorRowWin(row) == NULL)
+      editorRowMakeLong(row);
+    if (!editorRowLexReady(row, in, row->size))
+    {
+      editorHighlightCatchUp(line, in, row->size);
+      return -1;
+    }
   }
-  E.cy++;
-  E.cx = 0;
+  return editorRowSyntaxOut(row, in);
 }
 
-void editorDelChar()
+//Compute the first checkpoint that is not up to date, 0 if that had to start over
+int editorSyntaxAddCheckpoint()
 {
- if(E.cy== E.numRows)
- {
-  return;
- }
- if (E.cx == 0 && E.cy == 0) 
-   return;
- erow *row = &E.row[E.cy];
- if(E.cx>0)
- {
-  editorRowDelChar(row, E.cx-1);
-  E.cx--;
-  } 
-  else 
+  int last = E.hlCheckValid - 1;
+  int state = last > 0 ? E.hlCheck[last] : 0;
+  int line;
+  for (line = last * HL_CHECKPOINT_LINES; line < (last + 1) * HL_CHECKPOINT_LINES; line++)
+    if ((state = editorLineSyntaxOut(line, state)) < 0)
+      return 0;
+  if (E.hlCheckValid >= E.hlCheckCap)
   {
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-    editorDelRow(E.cy);
-    E.cy--;
+    E.hlCheckCap = E.hlCheckCap ? E.hlCheckCap * 2 : 64;
+    E.hlCheck = realloc(E.hlCheck, E.hlCheckCap);
+    if (E.hlCheck == NULL)
+      die("realloc");
+    E.hlCheck[0] = 0;
   }
+  E.hlCheck[E.hlCheckValid++] = state;
+  return 1;
 }
 
-/*** file i/o ***/
+//Comment state at the start of a line, -1 if the lock was let go on the way
+int editorSyntaxStateAt(int filerow)
+{
+  if (E.syntax == NULL)
+    return 0;
+  int k = filerow / HL_CHECKPOINT_LINES;
+  while (E.hlCheckValid <= k)
+    if (!editorSyntaxAddCheckpoint())
+      return -1;
+  int state = k > 0 ? E.hlCheck[k] : 0;
+  int line;
+  for (line = k * HL_CHECKPOINT_LINES; line < filerow && state >= 0; line++)
+    state = editorLineSyntaxOut(line, state);
+  return state;
+}
 
+/*** background highlighter ***/
 
-char *editorRowsToString(int *buflen)                           //Function to store the contents of a file in a variable
-{   
-  int totlen = 0;
-  int j;
-  //Calculate the total length of the file + 1 for \n on each row
-  for (j = 0; j < E.numRows; j++)
+/*
+ Highlighting runs on its own thread so that a keystroke never waits for it.
+ After every frame the main thread asks for the rows it just drew; the
+ highlighter works out their start states from the checkpoints and computes
+ highlights on a copy of each render with the lock released. A result is
+ only published if the row was not edited in the meantime (row->gen and
+ E.hlVersion), and the main thread is woken through hlPipe to repaint.
+ Until then rows are drawn with whatever snapshot they have, or HL_NORMAL.
+*/
+//Turn one class per column into runs, in a malloc'ed array
+unsigned int *editorHlEncode(const unsigned char *hl, int len, int *nruns)
+{
+  int n = 0, i;
+  for (i = 0; i < len; i++)
+    if (i + 1 == len || hl[i + 1] != hl[i])
+      n++;
+  unsigned int *runs = malloc(sizeof(unsigned int) * (n + 1));
+  if (runs == NULL)
+    die("malloc");
+  n = 0;
+  for (i = 0; i < len; i++)
+    if (i + 1 == len || hl[i + 1] != hl[i])
+      runs[n++] = (unsigned int)(i + 1) << HL_RUN_BITS | hl[i];
+  *nruns = n;
+  return runs;
+}
+
+//Publish a highlight snapshot, the row keeps a copy from row memory
+void editorRowSetHl(erow *row, unsigned int *runs, int nruns)
+{
+  rowFree(row->hl);
+  row->hl = NULL;
+  if (nruns)
   {
-    totlen += E.row[j].size + 1;
+    row->hl = rowAlloc(sizeof(unsigned int) * nruns);
+    memcpy(row->hl, runs, sizeof(unsigned int) * nruns);
   }
-  *buflen = totlen;
-  char *buf = malloc(totlen);
-  char *p = buf;
-  //Copying the contents of the file into a variable
-  for (j = 0; j < E.numRows; j++) 
+  row->hlruns = nruns;
+}
+
+//Column just past the last one the row's highlight covers
+int editorRowHlEnd(erow *row)
+{
+  return row->hlruns ? HL_RUN_END(row->hl[row->hlruns - 1]) : 0;
+}
+
+/*
+ Bring the lexer checkpoints of a long row up to cx a chunk at a time,
+ letting the main thread in between. 0 if rows were added or removed meanwhile.
+*/
+int editorHighlightCatchUp(int filerow, int in, int cx)
+{
+  unsigned long version = E.hlVersion;
+  erow *row = editorRowAt(filerow);
+  while (!editorRowLexReady(row, in, cx))
   {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    //adding \n after every row
-    *p = '\n';
-    p++;
+    editorRowLexAdvance(row, in);
+    pthread_mutex_unlock(&E.lock);
+    pthread_mutex_lock(&E.lock);
+    if (E.hlVersion != version || E.syntax == NULL || E.syntax->dfa == NULL)
+      return 0;
+    row = editorRowAt(filerow);
+    if (editorRowWin(row) == NULL)
+      return 0;
   }
-  return buf;
+  return 1;
 }
 
-void editorOpen(char *filename)
- {
-  free(E.filename);
-  E.filename = strdup(filename);
+void *editorHighlighter(void *arg)
+{
+  (void)arg;
+  unsigned long seen = 0;
+  pthread_mutex_lock(&E.lock);
+  while (1)
+  {
+    while (E.hlRequest == seen)
+      pthread_cond_wait(&E.hlCond, &E.lock);
+    seen = E.hlRequest;
+    if (E.syntax == NULL)
+      continue;
 
-  editorSelectSyntaxHighlight();
+    //Catching up on checkpoints can take a while, let the main thread in between
+    while (E.syntax && E.hlTop < E.numRows && E.hlCheckValid <= E.hlTop / HL_CHECKPOINT_LINES)
+    {
+      editorSyntaxAddCheckpoint();
+      pthread_mutex_unlock(&E.lock);
+      pthread_mutex_lock(&E.lock);
+    }
+    if (E.syntax == NULL || E.hlTop >= E.numRows)
+      continue;
+
+    int filerow = E.hlTop;
+    int end = E.hlTop + E.hlRows;
+    int state = editorSyntaxStateAt(filerow);
+    if (state < 0)
+    {
+      seen--;                                     //Rows may have changed while a long one was lexed, look again
+      continue;
+    }
+    int published = 0;
+    for (; filerow < end && filerow < E.numRows; filerow++)
+    {
+      erow *row = editorRowAt(filerow);
+      editorRowRender(row);
+      struct rowWindow *w = editorRowWin(row);
+      if (w)
+      {
+        //Long rows: highlight the rendered window from the lexer state at its start
+        int more = filerow + 1 < end && filerow + 1 < E.numRows;
+        if (E.syntax->dfa == NULL)
+        {
+          editorRowSetHl(row, NULL, 0);           //The reference lexer cannot start mid-row
+          if (more)
+            state = editorRowSyntaxOut(row, state);
+          continue;
+        }
+        if (!(row->flags & ROW_HL_VALID) || !(row->flags & ROW_HL_IN) != !state ||
+            w->hlstart != w->rstart || editorRowHlEnd(row) != row->rsize)
+        {
+          if (!editorHighlightCatchUp(filerow, state, w->rcx))
+            break;
+          row = editorRowAt(filerow);
+          editorRowRender(row);
+          w = editorRowWin(row);
+          int len = row->rsize;
+          int rstart = w->rstart;
+          int lex = editorRowLexState(row, state, w->rcx);
+          char *text = malloc(len + 1);
+          unsigned char *hl = malloc(len + 1);
+          if (text == NULL || hl == NULL)
+            die("malloc");
+          memcpy(text, row->render, len);
+          unsigned int gen = row->gen;
+          unsigned long version = E.hlVersion;
+          struct editorSyntax *syntax = E.syntax;
 
-  FILE *fp = fopen(filename, "r");
-  if (!fp) 
-    die("fopen");
+          pthread_mutex_unlock(&E.lock);
+          editorHighlightDFA(syntax, text, len, hl, lex);
+          int nruns;
+          unsigned int *runs = editorHlEncode(hl, len, &nruns);
+          free(text);
+          free(hl);
+          pthread_mutex_lock(&E.lock);
 
-  char *line = NULL;                                     // buffer
-  size_t linecap = 0;                                    //line capacity: size of line 
-  ssize_t linelen;                                       //to store the length of the line
-  while ((linelen = getline(&line, &linecap, fp)) != -1)             //to get the length of the line
-   {
-    while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-       linelen--;
+          if (E.hlVersion != version || editorRowAt(filerow)->gen != gen)
+          {
+            free(runs);
+            break;
+          }
+          row = editorRowAt(filerow);
+          editorRowSetHl(row, runs, nruns);
+          free(runs);
+          editorRowWin(row)->hlstart = rstart;
+          row->flags &= ~ROW_HL_IN;
+          row->flags |= ROW_HL_VALID | (state ? ROW_HL_IN : 0);
+          published = 1;
+        }
+        if (!more)
+          break;
+        if (!editorHighlightCatchUp(filerow, state, row->size))
+          break;
+        state = editorRowSyntaxOut(editorRowAt(filerow), state);
+        continue;
+      }
+      if ((row->flags & ROW_HL_VALID) && !(row->flags & ROW_HL_IN) == !state)
+      {
+        state = (row->flags & ROW_HL_OUT) != 0;
+        continue;
+      }
+      int len = row->rsize;
+      char *text = malloc(len + 1);
+      unsigned char *hl = malloc(len + 1);
+      if (text == NULL || hl == NULL)
+        die("malloc");
+      memcpy(text, row->render, len);
+      unsigned int gen = row->gen;
+      unsigned long version = E.hlVersion;
+      struct editorSyntax *syntax = E.syntax;
 
-    editorInsertRow(E.numRows, line,linelen );
-   }
-  free(line);
-  fclose(fp);
-  E.dirty=0;
+      pthread_mutex_unlock(&E.lock);
+      int out = editorHighlightLine(syntax, text, len, hl, state);
+      int nruns;
+      unsigned int *runs = editorHlEncode(hl, len, &nruns);
+      free(text);
+      free(hl);
+      pthread_mutex_lock(&E.lock);
+
+      if (E.hlVersion != version || editorRowAt(filerow)->gen != gen)
+      {
+        free(runs);
+        break;                                    //Picked up again after the next frame
+      }
+      row = editorRowAt(filerow);
+      editorRowSetHl(row, runs, nruns);
+      free(runs);
+      row->flags &= ~(ROW_HL_IN | ROW_HL_OUT);
+      row->flags |= ROW_HL_VALID | (state ? ROW_HL_IN : 0) | (out ? ROW_HL_OUT : 0);
+      state = out;
+      published = 1;
+    }
+    if (published && write(E.hlPipe[1], "h", 1) == -1 && errno != EAGAIN)
+      die("write");
+  }
+  return NULL;
 }
 
-void editorSave()                     //Function to save the edited file
+//Called after a frame was drawn with the rows it showed
+void editorRequestHighlight()
 {
-  if (E.filename == NULL) 
+  if (E.syntax == NULL)
+    return;
+  E.hlTop = E.rowoff;
+  E.hlRows = E.screenRows;
+  E.hlRequest++;
+  pthread_cond_signal(&E.hlCond);
+}
+
+void editorStartHighlighter()
+{
+  pthread_t thread;
+  if (pipe(E.hlPipe) == -1)
+    die("pipe");
+  fcntl(E.hlPipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(E.hlPipe[1], F_SETFL, O_NONBLOCK);
+  pthread_mutex_lock(&E.lock);
+  if (pthread_create(&thread, NULL, editorHighlighter, NULL) != 0)
+    die("pthread_create");
+  pthread_detach(thread);
+}
+
+int editorSyntaxToColor(int hl) 
+{
+  switch (hl) 
   {
-    E.filename = editorPrompt("Save as: %s (ESC to cancel)",NULL);
-    if (E.filename == NULL) 
-    {
-      editorSetStatusMessage("Save aborted");
-      return;
-    }
-    editorSelectSyntaxHighlight();
+    case HL_NUMBER: 
+        return 31;
+    case HL_MATCH:
+        return 34;
+    case HL_STRING:
+        return 35;
+    case HL_COMMENT:
+    case HL_MLCOMMENT:
+        return 36;
+    case HL_KEYWORD1: 
+        return 33;
+    case HL_KEYWORD2: 
+        return 32;
+    default:
+        return 37;
   }
-  int len;
-  char *buf = editorRowsToString(&len);
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  //ftruncate ensures the file is as big as the buffer, if bigger it truncates the file
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) 
+}
+
+void editorSelectSyntaxHighlight() 
+{
+  E.syntax = NULL;
+  E.hlCheckValid = 1;
+  E.hlVersion++;
+  if (E.filename == NULL) 
+     return;
+  char *ext = strrchr(E.filename, '.');
+  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) 
+  {
+    struct editorSyntax *s = &HLDB[j];
+    unsigned int i = 0;
+    while (s->filematch[i])
      {
-      if (write(fd, buf, len) == len) 
+      int is_ext = (s->filematch[i][0] == '.');
+      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+          (!is_ext && strstr(E.filename, s->filematch[i]))) 
       {
-        close(fd);
-        free(buf);
-        E.dirty=0;
-        editorSetStatusMessage("%d bytes written to disk", len);
+        E.syntax = s;
+        editorCompileSyntaxOnce(s);
+        int filerow;
+        for (filerow = 0; filerow < E.numRows; filerow++) 
+        {
+          erow *row = editorRowPeek(filerow);
+          if (row)
+            row->flags &= ~ROW_HL_VALID;
+        }
+        E.hlCheckValid = 1;
+        E.hlVersion++;
         return;
       }
+      i++;
     }
-    close(fd);
   }
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
 }
 
-/*** find ***/
+/*** unicode ***/
 
-void editorFindCallback(char *query, int key) 
+/*
+ Rows are UTF-8. What takes columns on screen is a grapheme: a code point
+ with the combining marks, variation selectors, emoji modifiers and zero
+ width joined code points after it, or a pair of regional indicators. It is
+ two columns wide for East Asian wide and fullwidth characters and emoji,
+ otherwise one. Bytes that aren't UTF-8 are one column each, drawn as '?'.
+*/
+
+struct cpRange
+{
+  int first;
+  int last;
+};
+
+//Code points that join the one before them
+const struct cpRange zeroWidth[] = {
+  {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x05bf, 0x05bf}, {0x05c1, 0x05c2},
+  {0x05c4, 0x05c5}, {0x05c7, 0x05c7}, {0x0610, 0x061a}, {0x064b, 0x065f}, {0x0670, 0x0670},
+  {0x06d6, 0x06dc}, {0x06df, 0x06e4}, {0x06e7, 0x06e8}, {0x06ea, 0x06ed}, {0x0711, 0x0711},
+  {0x0730, 0x074a}, {0x07a6, 0x07b0}, {0x07eb, 0x07f3}, {0x0816, 0x082d}, {0x0859, 0x085b},
+  {0x08d3, 0x08e1}, {0x08e3, 0x0903}, {0x093a, 0x093c}, {0x093e, 0x094f}, {0x0951, 0x0957},
+  {0x0962, 0x0963}, {0x0981, 0x0983}, {0x09bc, 0x09bc}, {0x09be, 0x09cd}, {0x09d7, 0x09d7},
+  {0x09e2, 0x09e3}, {0x0a01, 0x0a03}, {0x0a3c, 0x0a51}, {0x0a70, 0x0a71}, {0x0a75, 0x0a75},
+  {0x0a81, 0x0a83}, {0x0abc, 0x0abc}, {0x0abe, 0x0acd}, {0x0ae2, 0x0ae3}, {0x0b01, 0x0b03},
+  {0x0b3c, 0x0b3c}, {0x0b3e, 0x0b57}, {0x0b62, 0x0b63}, {0x0b82, 0x0b82}, {0x0bbe, 0x0bcd},
+  {0x0bd7, 0x0bd7}, {0x0c00, 0x0c04}, {0x0c3e, 0x0c56}, {0x0c62, 0x0c63}, {0x0c81, 0x0c83},
+  {0x0cbc, 0x0cbc}, {0x0cbe, 0x0cd6}, {0x0ce2, 0x0ce3}, {0x0d00, 0x0d03}, {0x0d3b, 0x0d3c},
+  {0x0d3e, 0x0d4d}, {0x0d57, 0x0d57}, {0x0d62, 0x0d63}, {0x0d81, 0x0d83}, {0x0dca, 0x0ddf},
+  {0x0df2, 0x0df3}, {0x0e31, 0x0e31}, {0x0e34, 0x0e3a}, {0x0e47, 0x0e4e}, {0x0eb1, 0x0eb1},
+  {0x0eb4, 0x0ebc}, {0x0ec8, 0x0ecd}, {0x0f18, 0x0f19}, {0x0f35, 0x0f35}, {0x0f37, 0x0f37},
+  {0x0f39, 0x0f39}, {0x0f3e, 0x0f3f}, {0x0f71, 0x0f84}, {0x0f86, 0x0f87}, {0x0f8d, 0x0fbc},
+  {0x0fc6, 0x0fc6}, {0x102b, 0x103e}, {0x1056, 0x1059}, {0x105e, 0x1060}, {0x1062, 0x1064},
+  {0x1067, 0x106d}, {0x1071, 0x1074}, {0x1082, 0x108d}, {0x108f, 0x108f}, {0x109a, 0x109d},
+  {0x1160, 0x11ff}, {0x135d, 0x135f}, {0x1712, 0x1714}, {0x1732, 0x1734}, {0x1752, 0x1753},
+  {0x1772, 0x1773}, {0x17b4, 0x17d3}, {0x17dd, 0x17dd}, {0x180b, 0x180d}, {0x1885, 0x1886},
+  {0x18a9, 0x18a9}, {0x1920, 0x193b}, {0x1a17, 0x1a1b}, {0x1a55, 0x1a7f}, {0x1ab0, 0x1aff},
+  {0x1b00, 0x1b04}, {0x1b34, 0x1b44}, {0x1b6b, 0x1b73}, {0x1b80, 0x1b82}, {0x1ba1, 0x1bad},
+  {0x1be6, 0x1bf3}, {0x1c24, 0x1c37}, {0x1cd0, 0x1cd2}, {0x1cd4, 0x1ce8}, {0x1ced, 0x1ced},
+  {0x1cf4, 0x1cf4}, {0x1cf7, 0x1cf9}, {0x1dc0, 0x1dff}, {0x200b, 0x200f}, {0x202a, 0x202e},
+  {0x2060, 0x2064}, {0x20d0, 0x20f0}, {0x2cef, 0x2cf1}, {0x2d7f, 0x2d7f}, {0x2de0, 0x2dff},
+  {0x302a, 0x302f}, {0x3099, 0x309a}, {0xa66f, 0xa672}, {0xa674, 0xa67d}, {0xa69e, 0xa69f},
+  {0xa6f0, 0xa6f1}, {0xa802, 0xa802}, {0xa806, 0xa806}, {0xa80b, 0xa80b}, {0xa823, 0xa827},
+  {0xa880, 0xa881}, {0xa8b4, 0xa8c5}, {0xa8e0, 0xa8f1}, {0xa926, 0xa92d}, {0xa947, 0xa953},
+  {0xa980, 0xa983}, {0xa9b3, 0xa9c0}, {0xaa29, 0xaa36}, {0xaa43, 0xaa43}, {0xaa4c, 0xaa4d},
+  {0xaaeb, 0xaaef}, {0xaaf5, 0xaaf6}, {0xabe3, 0xabea}, {0xabec, 0xabed}, {0xfb1e, 0xfb1e},
+  {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f}, {0xfeff, 0xfeff}, {0x1d165, 0x1d169}, {0x1d16d, 0x1d172},
+  {0x1d17b, 0x1d182}, {0x1d185, 0x1d18b}, {0x1d1aa, 0x1d1ad}, {0xe0001, 0xe007f}, {0xe0100, 0xe01ef}
+};
+
+//East Asian wide and fullwidth code points and emoji
+const struct cpRange wideWidth[] = {
+  {0x1100, 0x115f}, {0x231a, 0x231b}, {0x2329, 0x232a}, {0x23e9, 0x23ec}, {0x23f0, 0x23f0},
+  {0x23f3, 0x23f3}, {0x25fd, 0x25fe}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267f, 0x267f},
+  {0x2693, 0x2693}, {0x26a1, 0x26a1}, {0x26aa, 0x26ab}, {0x26bd, 0x26be}, {0x26c4, 0x26c5},
+  {0x26ce, 0x26ce}, {0x26d4, 0x26d4}, {0x26ea, 0x26ea}, {0x26f2, 0x26f3}, {0x26f5, 0x26f5},
+  {0x26fa, 0x26fa}, {0x26fd, 0x26fd}, {0x2705, 0x2705}, {0x270a, 0x270b}, {0x2728, 0x2728},
+  {0x274c, 0x274c}, {0x274e, 0x274e}, {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+  {0x27b0, 0x27b0}, {0x27bf, 0x27bf}, {0x2b1b, 0x2b1c}, {0x2b50, 0x2b50}, {0x2b55, 0x2b55},
+  {0x2e80, 0x303e}, {0x3041, 0x33ff}, {0x3400, 0x4dbf}, {0x4e00, 0x9fff}, {0xa000, 0xa4cf},
+  {0xa960, 0xa97f}, {0xac00, 0xd7a3}, {0xf900, 0xfaff}, {0xfe10, 0xfe19}, {0xfe30, 0xfe6f},
+  {0xff00, 0xff60}, {0xffe0, 0xffe6}, {0x16fe0, 0x16fe4}, {0x17000, 0x18aff}, {0x1b000, 0x1b2ff},
+  {0x1f004, 0x1f004}, {0x1f0cf, 0x1f0cf}, {0x1f18e, 0x1f18e}, {0x1f191, 0x1f19a}, {0x1f200, 0x1f202},
+  {0x1f210, 0x1f23b}, {0x1f240, 0x1f248}, {0x1f250, 0x1f251}, {0x1f260, 0x1f265}, {0x1f300, 0x1f320},
+  {0x1f32d, 0x1f335}, {0x1f337, 0x1f37c}, {0x1f37e, 0x1f393}, {0x1f3a0, 0x1f3ca}, {0x1f3cf, 0x1f3d3},
+  {0x1f3e0, 0x1f3f0}, {0x1f3f4, 0x1f3f4}, {0x1f3f8, 0x1f43e}, {0x1f440, 0x1f440}, {0x1f442, 0x1f4fc},
+  {0x1f4ff, 0x1f53d}, {0x1f54b, 0x1f54e}, {0x1f550, 0x1f567}, {0x1f57a, 0x1f57a}, {0x1f595, 0x1f596},
+  {0x1f5a4, 0x1f5a4}, {0x1f5fb, 0x1f64f}, {0x1f680, 0x1f6c5}, {0x1f6cc, 0x1f6cc}, {0x1f6d0, 0x1f6d2},
+  {0x1f6d5, 0x1f6d7}, {0x1f6eb, 0x1f6ec}, {0x1f6f4, 0x1f6fc}, {0x1f7e0, 0x1f7eb}, {0x1f90c, 0x1f93a},
+  {0x1f93c, 0x1f945}, {0x1f947, 0x1f9ff}, {0x1fa70, 0x1faff}, {0x20000, 0x2fffd}, {0x30000, 0x3fffd}
+};
+
+#define ZERO_WIDTH_JOINER 0x200d
+#define IS_REGIONAL(cp) ((cp) >= 0x1f1e6 && (cp) <= 0x1f1ff)
+#define IS_EMOJI_MODIFIER(cp) ((cp) >= 0x1f3fb && (cp) <= 0x1f3ff)
+
+int cpInRanges(const struct cpRange *r, int n, int cp)
+{
+  int lo = 0, hi = n;
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (r[mid].last < cp)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < n && r[lo].first <= cp;
+}
+
+//Columns of a code point on its own, 0 for those that join the one before
+int unicodeWidth(int cp)
 {
-  static int last_match = -1;
-  static int direction = 1;
+  static unsigned char bmp[0x10000];            //Width + 1 of the code points looked up so far
+  if (cp < 0x300)
+    return 1;
+  if (cp < 0x10000 && bmp[cp])
+    return bmp[cp] - 1;
+  int w = 1;
+  if (cpInRanges(zeroWidth, sizeof(zeroWidth) / sizeof(zeroWidth[0]), cp))
+    w = 0;
+  else if (cpInRanges(wideWidth, sizeof(wideWidth) / sizeof(wideWidth[0]), cp))
+    w = 2;
+  if (cp < 0x10000)
+    bmp[cp] = w + 1;
+  return w;
+}
 
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
-  if (saved_hl) 
+//Decode the code point at s, returns its length or 0 if s doesn't start with valid UTF-8
+int utf8Decode(const char *s, int len, int *cp)
+{
+  const unsigned char *u = (const unsigned char *)s;
+  int n, c, min, i;
+  if (u[0] < 0x80)
   {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
+    *cp = u[0];
+    return 1;
   }
- 
-  if (key == '\r' || key == '\x1b') 
+  if ((u[0] & 0xe0) == 0xc0)
   {
-    last_match = -1;
-    direction = 1;
-    return;
+    n = 2;
+    c = u[0] & 0x1f;
+    min = 0x80;
   }
-  else if (key == ARROW_RIGHT || key == ARROW_DOWN) 
+  else if ((u[0] & 0xf0) == 0xe0)
   {
-    direction = 1;
+    n = 3;
+    c = u[0] & 0x0f;
+    min = 0x800;
   }
-  else if (key == ARROW_LEFT || key == ARROW_UP) 
+  else if ((u[0] & 0xf8) == 0xf0)
   {
-    direction = -1;
+    n = 4;
+    c = u[0] & 0x07;
+    min = 0x10000;
   }
-  else 
+  else
+    return 0;
+  if (len < n)
+    return 0;
+  for (i = 1; i < n; i++)
+  {
+    if ((u[i] & 0xc0) != 0x80)
+      return 0;
+    c = c << 6 | (u[i] & 0x3f);
+  }
+  if (c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff))
+    return 0;
+  *cp = c;
+  return n;
+}
+
+/*
+ Length of the grapheme at s and its columns in *width, 0 when it is only
+ marks with nothing to join. Graphemes are cut at CELL_GLYPH - 2 bytes so a
+ screen cell can hold one with a letter or space in front; what is left over
+ is a grapheme of its own.
+*/
+int utf8Grapheme(const char *s, int len, int *width)
+{
+  int cp, next, k;
+  int n = utf8Decode(s, len, &cp);
+  if (n == 0)
+  {
+    *width = 1;
+    return 1;
+  }
+  if (len > CELL_GLYPH - 2)
+    len = CELL_GLYPH - 2;
+  int w = unicodeWidth(cp), prev = cp;
+  while (n < len && (s[n] & 0x80) && (k = utf8Decode(s + n, len - n, &next)) > 0)
   {
-    last_match = -1;
-    direction = 1;
+    if (!(prev == ZERO_WIDTH_JOINER || unicodeWidth(next) == 0 || IS_EMOJI_MODIFIER(next) ||
+          (n == 4 && IS_REGIONAL(cp) && IS_REGIONAL(next))))
+      break;
+    if (next == 0xfe0f || IS_REGIONAL(next))    //Emoji presentation, flags
+      w = 2;
+    n += k;
+    prev = next;
   }
+  *width = w;
+  return n;
+}
 
-  if (last_match == -1) 
-    direction = 1;
-  int current = last_match;
-  int i;
-  for (i = 0; i < E.numRows; i++) 
+//Index of the first tab or byte above 0x7f in s, n if there is none
+size_t wideScalar(const char *s, size_t n)
+{
+  size_t i;
+  for (i = 0; i < n; i++)
+    if (s[i] == '\t' || (s[i] & 0x80))
+      return i;
+  return n;
+}
+
+#ifdef HAVE_X86_SIMD
+//The high bits come straight out of movemask, tabs need one compare
+__attribute__((target("sse2")))
+size_t wideSSE2(const char *s, size_t n)
+{
+  const __m128i tab = _mm_set1_epi8('\t');
+  size_t i;
+  for (i = 0; i + 16 <= n; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    unsigned int mask = _mm_movemask_epi8(v) | _mm_movemask_epi8(_mm_cmpeq_epi8(v, tab));
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+  return i + wideScalar(s + i, n - i);
+}
+
+__attribute__((target("avx2")))
+size_t wideAVX2(const char *s, size_t n)
+{
+  const __m256i tab = _mm256_set1_epi8('\t');
+  size_t i;
+  for (i = 0; i + 32 <= n; i += 32)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+    unsigned int mask = _mm256_movemask_epi8(v) | _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, tab));
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+  return i + wideScalar(s + i, n - i);
+}
+#endif
+
+size_t (*wideKernel)(const char *, size_t) = wideScalar;
+
+void selectWideKernel()
+{
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    wideKernel = wideAVX2;
+  else if (__builtin_cpu_supports("sse2"))
+    wideKernel = wideSSE2;
+#endif
+}
+
+/*** row memory ***/
+
+/*
+ chars, render and hl of rows come from here rather than straight from
+ malloc. Blocks up to ROW_CLASS_MIN << (ROW_CLASSES - 1) bytes are carved out
+ of slabs and recycled through a free list per size class, bigger ones are
+ malloc'ed with some slack. Every block starts with its capacity, so a row
+ that grows by a byte only moves when it outgrows its block. Rows read from
+ the file need none of this, they point into the one buffer it was read or
+ mapped into. Only used with E.lock held.
+*/
+#define ROW_HEADER sizeof(size_t)
+
+int rowClass(size_t n)
+{
+  int k = 0;
+  while (k < ROW_CLASSES && (size_t)ROW_CLASS_MIN << k < n + ROW_HEADER)
+    k++;
+  return k;
+}
+
+size_t rowSize(void *p)
+{
+  size_t size;
+  memcpy(&size, (char *)p - ROW_HEADER, ROW_HEADER);
+  return size;
+}
+
+void *rowAlloc(size_t n)
+{
+  struct rowMem *m = &E.rowMem;
+  int k = rowClass(n);
+  size_t size;
+  char *b;
+  if (k == ROW_CLASSES)
+  {
+    size = n + n / 8 + ROW_HEADER;
+    b = malloc(size);
+    if (b == NULL)
+      die("malloc");
+    m->bigBytes += size;
+  }
+  else
+  {
+    size = (size_t)ROW_CLASS_MIN << k;
+    b = m->freeList[k];
+    if (b)
+      memcpy(&m->freeList[k], b + ROW_HEADER, sizeof(void *));
+    else
+    {
+      if (m->slabLeft < size)
+      {
+        m->slab = malloc(ROW_SLAB_SIZE);         //The rest of the old slab is lost, at most a block
+        if (m->slab == NULL)
+          die("malloc");
+        m->slabLeft = ROW_SLAB_SIZE;
+        m->slabBytes += ROW_SLAB_SIZE;
+      }
+      b = m->slab;
+      m->slab += size;
+      m->slabLeft -= size;
+    }
+  }
+  memcpy(b, &size, ROW_HEADER);
+  m->used += size;
+  m->allocs++;
+  return b + ROW_HEADER;
+}
+
+void rowFree(void *p)
+{
+  if (p == NULL)
+    return;
+  struct rowMem *m = &E.rowMem;
+  char *b = (char *)p - ROW_HEADER;
+  size_t size = rowSize(p);
+  m->used -= size;
+  m->frees++;
+  int k = rowClass(size - ROW_HEADER);
+  if (k == ROW_CLASSES)
+  {
+    m->bigBytes -= size;
+    free(b);
+    return;
+  }
+  memcpy(b + ROW_HEADER, &m->freeList[k], sizeof(void *));
+  m->freeList[k] = b;
+}
+
+//A block for n bytes whose old contents do not matter, p itself if it is big enough
+void *rowReuse(void *p, size_t n)
+{
+  if (p && n + ROW_HEADER <= rowSize(p))
+  {
+    E.rowMem.fits++;
+    return p;
+  }
+  rowFree(p);
+  return rowAlloc(n);
+}
+
+//Make room for n bytes in p, keeping its contents
+void *rowGrow(void *p, size_t n)
+{
+  if (p == NULL)
+    return rowAlloc(n);
+  struct rowMem *m = &E.rowMem;
+  size_t size = rowSize(p);
+  if (n + ROW_HEADER <= size)
+  {
+    m->fits++;
+    return p;
+  }
+  m->grows++;
+  if (rowClass(size - ROW_HEADER) == ROW_CLASSES)
+  {
+    //Big blocks keep growing with realloc, which can often extend them in place
+    size_t grown = n + n / 8 + ROW_HEADER;
+    char *b = realloc((char *)p - ROW_HEADER, grown);
+    if (b == NULL)
+      die("realloc");
+    memcpy(b, &grown, ROW_HEADER);
+    m->bigBytes += grown - size;
+    m->used += grown - size;
+    return b + ROW_HEADER;
+  }
+  char *q = rowAlloc(n);
+  memcpy(q, p, size - ROW_HEADER);
+  rowFree(p);
+  return q;
+}
+
+/*** row storage ***/
+
+/*
+ Rows live in a gap buffer so that inserting or deleting a line near the
+ previous edit only moves the rows between the old and the new gap position.
+ A row's line number is derived from its slot, so nothing has to be
+ renumbered when lines come and go.
+
+ Lines of the file buffer only get an erow once they are drawn or edited.
+ Until then their slot holds where they start in E.map, shifted left by two,
+ with SLOT_LINE set; SLOT_FOLLOWED says the next slot is the line after it in
+ E.map, so its length is known without looking for the newline. Other slots
+ point to their erow.
+*/
+#define ROW_GAP_MIN 16
+#define SLOT_LINE 1
+#define SLOT_FOLLOWED 2
+
+uint64_t *editorSlotAt(int at)
+{
+  if (at >= E.gapStart)
+    at += E.rowCap - E.numRows;
+  return &E.row[at];
+}
+
+//The erow of line at, NULL if it doesn't have one yet
+erow *editorRowPeek(int at)
+{
+  uint64_t s = *editorSlotAt(at);
+  return (s & SLOT_LINE) ? NULL : (erow *)(uintptr_t)s;
+}
+
+//Where line at starts
+char *editorLineStart(int at)
+{
+  uint64_t s = *editorSlotAt(at);
+  if (s & SLOT_LINE)
+    return E.map + (s >> 2);
+  return ((erow *)(uintptr_t)s)->chars;
+}
+
+//Chars and size of line at, without making an erow for it
+char *editorLineAt(int at, int *size)
+{
+  uint64_t s = *editorSlotAt(at);
+  if (!(s & SLOT_LINE))
+  {
+    erow *row = (erow *)(uintptr_t)s;
+    *size = row->size;
+    return row->chars;
+  }
+  char *start = E.map + (s >> 2), *end;
+  if (s & SLOT_FOLLOWED)
+    end = editorLineStart(at + 1) - 1;
+  else if ((end = memchr(start, '\n', E.map + E.mapSize - start)) == NULL)
+    end = E.map + E.mapSize;
+  while (E.mapCR && end > start && end[-1] == '\r')
+    end--;
+  *size = end - start;
+  return start;
+}
+
+//Are the chars of line at still in E.map
+int editorLineMapped(int at)
+{
+  erow *row = editorRowPeek(at);
+  return row == NULL || (row->flags & ROW_MAPPED);
+}
+
+//Does line at + 1 directly follow line at in the file buffer, with only the line ending between?
+int editorLineFollowed(int at)
+{
+  uint64_t s = *editorSlotAt(at);
+  if (s & SLOT_LINE)
+    return (s & SLOT_FOLLOWED) != 0;
+  if (!editorLineMapped(at) || !editorLineMapped(at + 1))
+    return 0;
+  erow *row = (erow *)(uintptr_t)s;
+  const char *end = row->chars + row->size, *next = editorLineStart(at + 1);
+  if (next <= end)
+    return 0;
+  while (end < next - 1 && *end == '\r')
+    end++;
+  return end == next - 1 && *end == '\n';
+}
+
+//Line at no longer has the one after it in E.map next to it
+void editorLineUnfollow(int at)
+{
+  if (at >= 0 && at < E.numRows && (*editorSlotAt(at) & SLOT_LINE))
+    *editorSlotAt(at) &= ~(uint64_t)SLOT_FOLLOWED;
+}
+
+//The erow of line at, made the first time it is asked for
+erow *editorRowAt(int at)
+{
+  uint64_t *s = editorSlotAt(at);
+  if (*s & SLOT_LINE)
+  {
+    erow *row = calloc(1, sizeof(erow));
+    if (row == NULL)
+      die("calloc");
+    row->chars = editorLineAt(at, &row->size);
+    row->flags = ROW_MAPPED;
+    row->slot = s - E.row;
+    *s = (uintptr_t)row;
+  }
+  return (erow *)(uintptr_t)*s;
+}
+
+int editorRowIndex(erow *row)
+{
+  int slot = row->slot;
+  if (slot >= E.gapStart)
+    slot -= E.rowCap - E.numRows;
+  return slot;
+}
+
+//Tell the erows in slots [from, to) where they are now
+void editorRowRenumber(int from, int to)
+{
+  for (; from < to; from++)
+    if (!(E.row[from] & SLOT_LINE))
+      ((erow *)(uintptr_t)E.row[from])->slot = from;
+}
+
+//Move the gap so that it starts at line 'at'
+void editorRowMoveGap(int at)
+{
+  int gap = E.rowCap - E.numRows;
+  if (at < E.gapStart)
+  {
+    memmove(&E.row[at + gap], &E.row[at], sizeof(uint64_t) * (E.gapStart - at));
+    editorRowRenumber(at + gap, E.gapStart + gap);
+  }
+  else if (at > E.gapStart)
+  {
+    memmove(&E.row[E.gapStart], &E.row[E.gapStart + gap], sizeof(uint64_t) * (at - E.gapStart));
+    editorRowRenumber(E.gapStart, at);
+  }
+  E.gapStart = at;
+}
+
+//Make room for at least n more rows, doubling the capacity when the gap runs out
+void editorRowReserve(size_t n)
+{
+  if (E.numRows + n <= (size_t)E.rowCap)
+    return;
+  size_t newcap = E.rowCap ? (size_t)E.rowCap * 2 : ROW_GAP_MIN;
+  if (newcap < E.numRows + n)
+    newcap = E.numRows + n;
+  uint64_t *new = realloc(E.row, sizeof(uint64_t) * newcap);
+  if (new == NULL)
+    die("realloc");
+  int tail = E.numRows - E.gapStart;
+  memmove(&new[newcap - tail], &new[E.gapStart], sizeof(uint64_t) * tail);
+  E.row = new;
+  E.rowCap = newcap;
+  editorRowRenumber(newcap - tail, newcap);
+}
+
+/***Row OPERATIONS***/
+
+//The long-row state of a row, NULL for ordinary rows
+struct rowWindow *editorRowWin(erow *row)
+{
+  return row->x ? row->x->win : NULL;
+}
+
+/*
+ Tabs and characters that aren't ASCII are the only ones that are not one
+ byte in one column, so the column of any position follows from the last of
+ them before it. Rows keep a sorted list of these wide characters and both
+ conversions are a binary search over it; other rows map columns one to one.
+*/
+
+//First wide character of a row at or after cx
+int editorRowWideAt(erow *row, int cx)
+{
+  int lo = 0, hi = row->x ? row->x->nwide : 0;
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (row->x->wide[mid].cx < cx)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/*
+ A walk over the characters of a row, from one that starts at 'from'. Marks
+ are only joined to an ASCII letter the walk went over, so walks started from
+ any character see the same ones as a walk from the start of the row.
+*/
+struct wideWalk
+{
+  int at;                                       //Where the next character starts
+  int rx;                                       //and its column
+  int from;
+  int last;                                     //End of the last wide character, -1 before the first
+};
+
+/*
+ Step to the next wide character that starts before to, counting a mark at
+ to that joins the letter before it. ASCII is skipped with wideKernel. If
+ there is none the walk stops at to and 0 is returned.
+*/
+int editorRowWalk(erow *row, struct wideWalk *k, int to, struct wideChar *c)
+{
+  const char *s = row->chars;
+  int at = k->at, end = to < row->size ? to + 1 : row->size;
+  if (at >= to)
+    return 0;
+  if (at < end && !(s[at] & 0x80))
+    at += wideKernel(&s[at], end - at);
+  if (at < end)
+  {
+    c->cx = at;
+    c->rx = k->rx + (at - k->at);
+    c->len = 1;
+    c->width = 1;
+    if (s[at] == '\t')
+      c->width = TAB_STOP - c->rx % TAB_STOP;
+    else
+    {
+      int w;
+      c->len = utf8Grapheme(&s[at], row->size - at, &w);
+      //Marks after an ASCII letter are drawn with it
+      if (w == 0 && at > k->from && s[at - 1] > ' ' && s[at - 1] < 0x7f && k->last < at)
+      {
+        c->cx--;
+        c->rx--;
+        c->len++;
+      }
+      c->width = w ? w : 1;
+    }
+    if (c->cx < to)
+    {
+      k->at = k->last = c->cx + c->len;
+      k->rx = c->rx + c->width;
+      return 1;
+    }
+  }
+  k->rx += to - k->at;
+  k->at = to;
+  return 0;
+}
+
+//Compute the first chunk entry of a long row that is not up to date
+void editorRowChunkAdvance(erow *row)
+{
+  struct rowWindow *w = row->x->win;
+  if (w->chunkValid == w->chunkCap)
+  {
+    w->chunkCap = w->chunkCap ? w->chunkCap * 2 : 64;
+    w->chunk = realloc(w->chunk, sizeof(struct wideChunk) * w->chunkCap);
+    if (w->chunk == NULL)
+      die("realloc");
+  }
+  int k = w->chunkValid;
+  struct wideChunk e = {0, 0};
+  if (k > 0)
+  {
+    struct wideWalk walk = {w->chunk[k - 1].cx, w->chunk[k - 1].rx, w->chunk[k - 1].cx, -1};
+    struct wideChar c;
+    while (editorRowWalk(row, &walk, k * LONG_LINE_CHUNK, &c))
+      ;
+    e.cx = walk.at;
+    e.rx = walk.rx;
+  }
+  w->chunk[k] = e;
+  w->chunkValid++;
+}
+
+//Start a walk of a long row from the last character it knows of at or before cx
+void editorRowWalkFrom(erow *row, int cx, struct wideWalk *walk)
+{
+  struct rowWindow *w = row->x->win;
+  int k = (cx < row->size ? cx : row->size) / LONG_LINE_CHUNK;
+  while (w->chunkValid <= k)
+    editorRowChunkAdvance(row);
+  while (k > 0 && w->chunk[k].cx > cx)
+    k--;
+  struct wideChunk e = w->chunk[k];
+  if (w->wideValid && w->rcx <= cx && w->rcx > e.cx)
+  {
+    e.cx = w->rcx;
+    e.rx = w->rstart;
+  }
+  walk->at = walk->from = e.cx;
+  walk->rx = e.rx;
+  walk->last = -1;
+}
+
+int editorRowCxToRx(erow *row, int cx) 
+{
+  editorRowIndexWide(row);
+  if (editorRowWin(row))
+  {
+    struct wideWalk walk;
+    struct wideChar c;
+    editorRowWalkFrom(row, cx, &walk);
+    while (editorRowWalk(row, &walk, cx, &c))
+      if (cx < c.cx + c.len)
+        return c.rx;
+    return walk.rx;
+  }
+  int k = editorRowWideAt(row, cx);
+  if (k == 0)
+    return cx;
+  struct wideChar *t = &row->x->wide[k - 1];
+  if (cx < t->cx + t->len)
+    return t->rx;
+  return t->rx + t->width + (cx - t->cx - t->len);
+}
+
+//Where a long row gets to column rx, walking from the chunk that has it
+int editorRowLongRxToCx(erow *row, int rx)
+{
+  struct rowWindow *w = row->x->win;
+  int last = row->size / LONG_LINE_CHUNK;
+  if (w->chunkValid == 0)
+    editorRowChunkAdvance(row);
+  while (w->chunkValid <= last && w->chunk[w->chunkValid - 1].rx <= rx)
+    editorRowChunkAdvance(row);
+  //First entry that starts after rx
+  int lo = 1, hi = w->chunkValid;
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (w->chunk[mid].rx <= rx)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  struct wideChunk e = w->chunk[lo - 1];
+  int to = lo < w->chunkValid ? w->chunk[lo].cx : row->size;
+  if (w->wideValid && w->rstart <= rx && w->rcx > e.cx && w->rcx < to)
+  {
+    e.cx = w->rcx;
+    e.rx = w->rstart;
+  }
+  struct wideWalk walk = {e.cx, e.rx, e.cx, -1};
+  struct wideChar c;
+  while (editorRowWalk(row, &walk, to, &c))
+    if (c.rx + c.width > rx)
+      return c.rx <= rx ? c.cx : c.cx - (c.rx - rx);
+  int cx = walk.at + (rx - walk.rx);
+  return cx < row->size ? cx : row->size;
+}
+
+int editorRowRxToCx(erow *row, int rx) 
+{
+  editorRowIndexWide(row);
+  if (editorRowWin(row))
+    return editorRowLongRxToCx(row, rx);
+  //First wide character that starts after rx
+  int lo = 0, hi = row->x ? row->x->nwide : 0;
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (row->x->wide[mid].rx <= rx)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  int cx = rx;
+  if (lo > 0)
+  {
+    struct wideChar *t = &row->x->wide[lo - 1];
+    int end = t->rx + t->width;
+    cx = rx < end ? t->cx : t->cx + t->len + (rx - end);
+  }
+  return cx < row->size ? cx : row->size;
+}
+
+//Where the character after the one at cx starts
+int editorRowNextCx(erow *row, int cx)
+{
+  editorRowIndexWide(row);
+  if (editorRowWin(row))
+  {
+    struct wideWalk walk;
+    struct wideChar c;
+    int next = cx + 1;
+    if (cx >= row->size)
+      return next;
+    editorRowWalkFrom(row, cx, &walk);
+    while (editorRowWalk(row, &walk, cx + 1, &c))
+      if (c.cx == cx)
+        next = cx + c.len;
+    return next;
+  }
+  if (row->flags & ROW_UNICODE)
+  {
+    int k = editorRowWideAt(row, cx);
+    if (k < row->x->nwide && row->x->wide[k].cx == cx)
+      return cx + row->x->wide[k].len;
+  }
+  return cx + 1;
+}
+
+//Where the character before cx starts, or the one cx is inside of
+int editorRowPrevCx(erow *row, int cx)
+{
+  editorRowIndexWide(row);
+  if (editorRowWin(row))
+  {
+    struct wideWalk walk;
+    struct wideChar c;
+    int prev = cx - 1;
+    if (cx <= 0)
+      return prev;
+    editorRowWalkFrom(row, cx - 1, &walk);
+    while (editorRowWalk(row, &walk, cx, &c))
+      prev = c.cx + c.len >= cx ? c.cx : cx - 1;
+    return prev;
+  }
+  if (row->flags & ROW_UNICODE)
+  {
+    int k = editorRowWideAt(row, cx);
+    if (k > 0 && row->x->wide[k - 1].cx + row->x->wide[k - 1].len >= cx)
+      return row->x->wide[k - 1].cx;
+  }
+  return cx - 1;
+}
+
+//Give the row's extra state room for cap wide characters
+void editorRowWideCap(erow *row, int cap)
+{
+  struct rowWindow *win = editorRowWin(row);
+  int n = row->x ? row->x->nwide : 0;
+  row->x = realloc(row->x, sizeof(struct rowExtra) + sizeof(struct wideChar) * cap);
+  if (row->x == NULL)
+    die("realloc");
+  row->x->win = win;
+  row->x->nwide = n < cap ? n : cap;
+  row->x->cap = cap;
+}
+
+//The row lists n wide characters, its extra state only exists while it holds something
+void editorRowSetWide(erow *row, int n)
+{
+  if (n == 0 && editorRowWin(row) == NULL)
+  {
+    free(row->x);
+    row->x = NULL;
+    return;
+  }
+  if (n < row->x->cap / 4)
+    editorRowWideCap(row, n);
+  row->x->nwide = n;
+}
+
+//Add the next wide character to the row's list, n are in it so far
+void editorRowAddWide(erow *row, int n, const struct wideChar *c)
+{
+  if (n == (row->x ? row->x->cap : 0))
+    editorRowWideCap(row, n ? n * 2 : 16);
+  row->x->wide[n] = *c;
+  if (row->chars[c->cx] != '\t')
+    row->flags |= ROW_UNICODE;
+}
+
+void editorRowFreeRender(erow *row)
+{
+  if (row->render != row->chars)
+    rowFree(row->render);
+  row->render = NULL;
+  row->rsize = 0;
+}
+
+/*
+ List the wide characters of a row, in the room it already has. ASCII is
+ skipped with wideKernel, so rows that are all ASCII cost one pass of it and
+ the tabs they have.
+*/
+void editorRowScanWide(erow *row)
+{
+  struct wideWalk walk = {0, 0, 0, -1};
+  struct wideChar c;
+  int n = 0;
+  row->flags &= ~ROW_UNICODE;
+  while (editorRowWalk(row, &walk, row->size, &c))
+    editorRowAddWide(row, n++, &c);
+  editorRowSetWide(row, n);
+}
+
+//Render chars[from..to) of a row into out, one byte per column, returns the columns
+int editorRowRenderRange(erow *row, int from, int to, char *out)
+{
+  int k = editorRowWideAt(row, from), idx = 0;
+  while (from < to)
+  {
+    struct wideChar *c = k < row->x->nwide ? &row->x->wide[k] : NULL;
+    int end = c && c->cx < to ? c->cx : to;
+    if (end > from)
+    {
+      memcpy(&out[idx], &row->chars[from], end - from);
+      idx += end - from;
+    }
+    if (end == to)
+      break;
+    if (row->chars[c->cx] == '\t')
+      memset(&out[idx], ' ', c->width);
+    else
+    {
+      out[idx] = RENDER_GLYPH;
+      if (c->width == 2)
+        out[idx + 1] = RENDER_WIDE;
+    }
+    idx += c->width;
+    from = c->cx + c->len;
+    k++;
+  }
+  return idx;
+}
+
+void editorRenderRow(erow *row)                 //Function to take care of tabs in the file 
+{
+  editorRowScanWide(row);
+  if (row->x == NULL)
+  {
+    //Nothing to expand, render is chars itself
+    editorRowFreeRender(row);
+    row->render = row->chars;
+    row->rsize = row->size;
+    return;
+  }
+  if (row->render == row->chars)
+    row->render = NULL;
+  struct wideChar *last = &row->x->wide[row->x->nwide - 1];
+  row->render = rowReuse(row->render, last->rx + last->width + (row->size - last->cx - last->len) + 1);
+  row->rsize = editorRowRenderRange(row, 0, row->size, row->render);
+  row->render[row->rsize] = '\0';
+}
+
+//Switch a row to long-line mode, dropping its full render and highlight
+void editorRowMakeLong(erow *row)
+{
+  if (row->x == NULL)
+  {
+    row->x = malloc(sizeof(struct rowExtra));
+    if (row->x == NULL)
+      die("malloc");
+    row->x->nwide = 0;
+    row->x->cap = 0;
+  }
+  row->x->win = calloc(1, sizeof(struct rowWindow));
+  if (row->x->win == NULL)
+    die("calloc");
+  editorRowFreeRender(row);
+  rowFree(row->hl);
+  row->hl = NULL;
+  row->hlruns = 0;
+  row->flags &= ~ROW_HL_VALID;
+  editorRowSetWide(row, 0);
+}
+
+void editorRowDropLong(erow *row)
+{
+  struct rowWindow *w = row->x->win;
+  free(w->lex);
+  free(w->chunk);
+  free(w);
+  row->x->win = NULL;
+  editorRowFreeRender(row);
+  rowFree(row->hl);
+  row->hl = NULL;
+  row->hlruns = 0;
+}
+
+//Long rows find wide characters from their chunk entries, other rows index them while rendering
+void editorRowIndexWide(erow *row)
+{
+  if (editorRowWin(row) == NULL && row->size >= LONG_LINE_MIN)
+    editorRowMakeLong(row);
+  if (editorRowWin(row) == NULL)
+    editorRowRender(row);
+}
+
+//Render the columns of a long row around the screen
+void editorRowRenderWindow(erow *row)
+{
+  struct rowWindow *w = row->x->win;
+  int from = E.coloff > LONG_LINE_MARGIN ? E.coloff - LONG_LINE_MARGIN : 0;
+  w->wideValid = 0;
+  w->rcx = editorRowRxToCx(row, from);
+  w->rend = editorRowRxToCx(row, E.coloff + E.screenCols + LONG_LINE_MARGIN);
+  if (w->rend < row->size)
+    w->rend = editorRowNextCx(row, w->rend);
+  w->rstart = editorRowCxToRx(row, w->rcx);
+  //List the wide characters of the window
+  struct wideWalk walk = {w->rcx, w->rstart, w->rcx, -1};
+  struct wideChar c;
+  int n = 0;
+  row->flags &= ~ROW_UNICODE;
+  while (editorRowWalk(row, &walk, w->rend, &c))
+    editorRowAddWide(row, n++, &c);
+  editorRowSetWide(row, n);
+  w->wideValid = 1;
+  row->rsize = walk.rx - w->rstart;
+  row->render = rowReuse(row->render, row->rsize + 1);
+  editorRowRenderRange(row, w->rcx, w->rend, row->render);
+  row->render[row->rsize] = '\0';
+}
+
+//Chars of a long row changed from at on: drop the lexer checkpoints and chunk entries after it
+void editorRowTouch(erow *row, int at)
+{
+  struct rowWindow *w = editorRowWin(row);
+  if (w == NULL)
+    return;
+  if (w->lexValid > at / LONG_LINE_CHUNK + 1)
+    w->lexValid = at / LONG_LINE_CHUNK + 1;
+  if (w->chunkValid > at / LONG_LINE_CHUNK + 1)
+    w->chunkValid = at / LONG_LINE_CHUNK + 1;
+  //Where a character ends depends on up to 4 bytes after it
+  while (w->chunkValid > 1 && w->chunk[w->chunkValid - 1].cx > at - 4)
+    w->chunkValid--;
+}
+
+//Are the checkpoints of a long row good up to cx for start state in
+int editorRowLexReady(erow *row, int in, int cx)
+{
+  struct rowWindow *w = row->x->win;
+  if (cx > row->size)
+    cx = row->size;
+  return w->lexDfa == E.syntax->dfa && w->lexIn == in && w->lexValid > cx / LONG_LINE_CHUNK;
+}
+
+//Compute the first checkpoint of a long row that is not up to date
+void editorRowLexAdvance(erow *row, int in)
+{
+  struct rowWindow *w = row->x->win;
+  const struct syntaxDFA *d = E.syntax->dfa;
+  if (w->lexDfa != d || w->lexIn != in)
+  {
+    w->lexDfa = d;
+    w->lexIn = in;
+    w->lexValid = 0;
+  }
+  if (w->lexValid == w->lexCap)
+  {
+    w->lexCap = w->lexCap ? w->lexCap * 2 : 64;
+    w->lex = realloc(w->lex, sizeof(int) * w->lexCap);
+    if (w->lex == NULL)
+      die("realloc");
+  }
+  int k = w->lexValid;
+  if (k == 0)
+    w->lex[0] = in ? d->startComment : d->start;
+  else
+  {
+    int from = (k - 1) * LONG_LINE_CHUNK;
+    w->lex[k] = editorHighlightDFA(E.syntax, &row->chars[from], LONG_LINE_CHUNK, NULL, w->lex[k - 1]);
+  }
+  w->lexValid++;
+}
+
+//Lexer state at chars[cx] of a long row, needs E.syntax->dfa
+int editorRowLexState(erow *row, int in, int cx)
+{
+  if (cx > row->size)
+    cx = row->size;
+  while (!editorRowLexReady(row, in, cx))
+    editorRowLexAdvance(row, in);
+  int k = cx / LONG_LINE_CHUNK;
+  return editorHighlightDFA(E.syntax, &row->chars[k * LONG_LINE_CHUNK], cx - k * LONG_LINE_CHUNK, NULL, row->x->win->lex[k]);
+}
+
+//The row's chars changed: render it again, its highlighting is redone when it is drawn
+void editorUpdateRow(erow *row)
+{
+  if (editorRowWin(row) && row->size < LONG_LINE_MIN / 2)
+    editorRowDropLong(row);
+  if (editorRowWin(row))
+  {
+    editorRowFreeRender(row);
+    row->x->win->wideValid = 0;
+  }
+  else if (row->size >= LONG_LINE_MIN)
+    editorRowMakeLong(row);
+  else
+    editorRenderRow(row);
+  row->gen++;
+  row->flags &= ~ROW_HL_VALID;
+  row->flags |= ROW_DIRTY;
+  editorInvalidateSyntax(editorRowIndex(row));
+  if (E.matchValid)
+    editorMatchesEdit(editorRowIndex(row), 0);
+}
+
+//Make sure the row is rendered, rows coming from the file buffer are rendered lazily
+void editorRowRender(erow *row)
+{
+  if (editorRowWin(row) == NULL && row->size >= LONG_LINE_MIN)
+    editorRowMakeLong(row);
+  struct rowWindow *w = editorRowWin(row);
+  if (w)
+  {
+    if (row->render == NULL || E.coloff < w->rstart ||
+        (E.coloff + E.screenCols > w->rstart + row->rsize && w->rend < row->size))
+      editorRowRenderWindow(row);
+  }
+  else if (row->render == NULL)
+    editorRenderRow(row);
+}
+
+//Give the row its own copy of chars before it gets modified
+void editorRowMaterialize(erow *row)
+{
+  if (row->render == row->chars)               //chars is about to change or move
+    row->render = NULL;
+  if (!(row->flags & ROW_MAPPED))
+    return;
+  int at = editorRowIndex(row);
+  editorLineUnfollow(at - 1);                   //Its length came from where this row starts
+  if (E.inPlace && !E.rowsMoved)
+  {
+    if (E.originCount == E.originCap)
+    {
+      E.originCap = E.originCap ? E.originCap * 2 : 64;
+      E.origins = realloc(E.origins, sizeof(struct rowOrigin) * E.originCap);
+      if (E.origins == NULL)
+        die("realloc");
+    }
+    struct rowOrigin *o = &E.origins[E.originCount++];
+    o->row = at;
+    o->size = row->size;
+    o->off = row->chars - E.map;
+  }
+  char *chars = rowAlloc(row->size + 1);
+  memcpy(chars, row->chars, row->size);
+  chars[row->size] = '\0';
+  row->chars = chars;
+  row->flags &= ~ROW_MAPPED;
+}
+
+//Append a line of the file buffer that follows the last one, it gets an erow when it is drawn or edited
+void editorInsertMappedRow(char *s)
+{
+  editorRowReserve(1);
+  editorRowMoveGap(E.numRows);
+  if (E.numRows > 0 && (E.row[E.numRows - 1] & SLOT_LINE))
+    E.row[E.numRows - 1] |= SLOT_FOLLOWED;
+  E.row[E.numRows] = (uint64_t)(s - E.map) << 2 | SLOT_LINE;
+  E.gapStart++;
+  E.numRows++;
+}
+
+void editorInsertRow(int at, char *s, size_t len) 
+{
+  if (at < 0 || at > E.numRows) 
+    return;
+  if (E.matchValid)                             //Before the rows below move, a pending range may need them
+    editorMatchesEdit(at, 1);
+
+  editorRowReserve(1);
+  editorRowMoveGap(at);
+
+  erow *row = calloc(1, sizeof(erow));
+  if (row == NULL)
+    die("calloc");
+  row->size = len;
+  row->chars = rowAlloc(len + 1);
+
+  memcpy(row->chars, s, len);
+
+  row->chars[len] = '\0';
+  row->slot = at;
+  E.row[at] = (uintptr_t)row;
+  editorLineUnfollow(at - 1);
+
+  E.gapStart++;
+  E.numRows++;
+  E.hlVersion++;
+  E.rowsMoved = 1;
+
+  editorUpdateRow(row);
+
+  E.dirty++;
+  
+}
+
+void editorFreeRow(erow *row) 
+{
+  if (editorRowWin(row))
+    editorRowDropLong(row);
+  editorRowFreeRender(row);
+  free(row->x);
+  if (!(row->flags & ROW_MAPPED))
+    rowFree(row->chars);
+  rowFree(row->hl);
+  free(row);
+}
+
+void editorDelRow(int at) {
+
+  if (at < 0 || at >= E.numRows) 
+    return;
+  if (E.matchValid)
+    editorMatchesEdit(at, -1);
+  editorRowMoveGap(at + 1);
+  if (!(E.row[at] & SLOT_LINE))
+    editorFreeRow((erow *)(uintptr_t)E.row[at]);
+  E.gapStart--;
+  E.numRows--;
+  editorLineUnfollow(at - 1);
+  E.hlVersion++;
+  E.rowsMoved = 1;
+  editorInvalidateSyntax(at);
+  E.dirty++;
+}
+
+void editorRowInsertString(erow *row, int at, const char *s, size_t len)
+{
+  if (at < 0 || at > row->size)
+     at = row->size;
+  editorRowMaterialize(row);
+  row->chars = rowGrow(row->chars, row->size + len + 1);
+  memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+  memcpy(&row->chars[at], s, len);
+  row->size += len;
+  editorRowTouch(row, at);
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+void editorRowInsertChar(erow *row, int at, int c)                  //Insert characters
+{
+  char ch = c;
+  editorRowInsertString(row, at, &ch, 1);
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) 
+{
+  editorRowMaterialize(row);
+  row->chars = rowGrow(row->chars, row->size + len + 1);
+  memcpy(&row->chars[row->size], s, len);
+  editorRowTouch(row, row->size);
+  row->size += len;
+  row->chars[row->size] = '\0';
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+void editorRowDelChar(erow *row, int at)            //Delete chars
+{
+ if(at < 0 || at >= row->size)
+  {
+    return;
+  }
+ editorRowMaterialize(row);
+ memmove(&row->chars[at], &row->chars[at+1],row->size - at);
+ row->size--;
+ editorRowTouch(row, at);
+ editorUpdateRow(row);
+ E.dirty++;
+}
+
+/*
+ Text spanning rows, with '\n' between them. These are what undo/redo and
+ pasting are built on: positions are (row, column) and lengths count one
+ byte for every line break.
+*/
+
+//Insert s at (at, col); the position after the inserted text is returned in *endRow/*endCol
+void editorInsertText(int at, int col, const char *s, size_t len, int *endRow, int *endCol)
+{
+  if (at == E.numRows)
+    editorInsertRow(at, "", 0);
+  erow *row = editorRowAt(at);
+  if (col > row->size)
+    col = row->size;
+  const char *nl = memchr(s, '\n', len);
+  if (nl == NULL)
+  {
+    editorRowInsertString(row, col, s, len);
+    *endRow = at;
+    *endCol = col + len;
+    return;
+  }
+
+  //The rest of the row moves to the end of the last inserted line
+  size_t tailLen = row->size - col;
+  char *tail = malloc(tailLen + 1);
+  if (tail == NULL)
+    die("malloc");
+  memcpy(tail, &row->chars[col], tailLen);
+  editorRowMaterialize(row);
+  row->size = col;
+  row->chars[col] = '\0';
+  editorRowTouch(row, col);
+  editorRowInsertString(row, col, s, nl - s);
+
+  const char *end = s + len;
+  const char *line = nl + 1;
+  while ((nl = memchr(line, '\n', end - line)) != NULL)
+  {
+    editorInsertRow(++at, (char *)line, nl - line);
+    line = nl + 1;
+  }
+  editorInsertRow(++at, (char *)line, end - line);
+  row = editorRowAt(at);
+  *endRow = at;
+  *endCol = row->size;
+  editorRowAppendString(row, tail, tailLen);
+  free(tail);
+}
+
+//Walk len bytes of text from (at, col)
+void editorTextEnd(int at, int col, size_t len, int *endRow, int *endCol)
+{
+  while (len > 0 && at < E.numRows)
+  {
+    int size;
+    editorLineAt(at, &size);
+    size_t avail = size - col;
+    if (len <= avail)
+    {
+      col += len;
+      break;
+    }
+    len -= avail + 1;
+    at++;
+    col = 0;
+  }
+  *endRow = at;
+  *endCol = col;
+}
+
+//Copy len bytes of text from (at, col) into dest
+void editorCopyText(int at, int col, size_t len, char *dest)
+{
+  while (len > 0 && at < E.numRows)
+  {
+    int size;
+    char *chars = editorLineAt(at, &size);
+    size_t n = size - col;
+    if (n > len)
+      n = len;
+    memcpy(dest, &chars[col], n);
+    dest += n;
+    len -= n;
+    if (len > 0)
+    {
+      *dest++ = '\n';
+      len--;
+    }
+    at++;
+    col = 0;
+  }
+}
+
+void editorDeleteText(int at, int col, size_t len)
+{
+  int endRow, endCol;
+  editorTextEnd(at, col, len, &endRow, &endCol);
+  erow *row = editorRowAt(at);
+  if (endRow == at)
+  {
+    editorRowMaterialize(row);
+    memmove(&row->chars[col], &row->chars[endCol], row->size - endCol + 1);
+    row->size -= endCol - col;
+    editorRowTouch(row, col);
+    editorUpdateRow(row);
+    E.dirty++;
+    return;
+  }
+  editorRowMaterialize(row);
+  row->size = col;
+  row->chars[col] = '\0';
+  editorRowTouch(row, col);
+  if (endRow < E.numRows)
+  {
+    erow *last = editorRowAt(endRow);
+    editorRowAppendString(row, &last->chars[endCol], last->size - endCol);
+  }
+  else
+    editorUpdateRow(row);
+  //Rows in between go from the top of the gap, which stays where it is
+  for (int i = at + 1; i <= endRow && at + 1 < E.numRows; i++)
+    editorDelRow(at + 1);
+}
+
+/*** undo ***/
+
+/*
+ Undo journal. Every edit is recorded as text inserted or deleted at a
+ position; the text itself goes into one arena, so typing a run of
+ characters or deleting one with backspace grows a single record instead of
+ allocating. Undo and redo replay a record as one edit, so undoing a large
+ paste deletes its rows once instead of restoring a copy of the buffer.
+ The oldest records are dropped when the journal gets over UNDO_MAX_BYTES,
+ but never the last edit, however big it is.
+*/
+#ifndef UNDO_MAX_BYTES
+#define UNDO_MAX_BYTES (64 << 20)
+#endif
+
+void editorUndoSeal()
+{
+  E.undoSealed = 1;
+}
+
+//The buffer matches the file now, getting back here by undo or redo clears dirty
+void editorUndoMarkSaved()
+{
+  E.undoSaved = E.undoPos;
+  E.undoSealed = 1;
+  E.dirty = 0;
+}
+
+//Drop the oldest records until the journal is under half its cap, keeping the newest edit
+void editorUndoTrim()
+{
+  size_t used = E.undoTextLen + sizeof(struct undoRec) * E.undoCount;
+  if (used <= UNDO_MAX_BYTES)
+    return;
+  int last = E.undoCount - 1;
+  while (last > 0 && (E.undo[last].flags & UNDO_JOIN))
+    last--;
+  int drop = 0;
+  while (drop < last && used > UNDO_MAX_BYTES / 2)
+  {
+    used -= E.undo[drop].len + sizeof(struct undoRec);
+    drop++;
+  }
+  //Records undone together go together
+  while (drop < E.undoCount && (E.undo[drop].flags & UNDO_JOIN))
+    drop++;
+  size_t textDrop = drop < E.undoCount ? E.undo[drop].off : E.undoTextLen;
+  memmove(E.undo, &E.undo[drop], sizeof(struct undoRec) * (E.undoCount - drop));
+  memmove(E.undoText, &E.undoText[textDrop], E.undoTextLen - textDrop);
+  E.undoCount -= drop;
+  E.undoPos = E.undoPos > drop ? E.undoPos - drop : 0;
+  E.undoSaved = E.undoSaved >= drop ? E.undoSaved - drop : -1;
+  E.undoTextLen -= textDrop;
+  for (int i = 0; i < E.undoCount; i++)
+    E.undo[i].off -= textDrop;
+}
+
+//Room for len more bytes of text, returned at the end of the arena
+char *editorUndoText(size_t len)
+{
+  if (E.undoTextLen + len > E.undoTextCap)
+  {
+    size_t cap = E.undoTextCap ? E.undoTextCap : 4096;
+    while (cap < E.undoTextLen + len)
+      cap *= 2;
+    E.undoText = realloc(E.undoText, cap);
+    if (E.undoText == NULL)
+      die("realloc");
+    E.undoTextCap = cap;
+  }
+  char *p = &E.undoText[E.undoTextLen];
+  E.undoTextLen += len;
+  return p;
+}
+
+struct undoRec *editorUndoAdd(int op, int row, int col, size_t len, int join)
+{
+  //A new edit forgets what was undone
+  if (E.undoSaved > E.undoPos)
+    E.undoSaved = -1;
+  E.undoCount = E.undoPos;
+  E.undoTextLen = E.undoCount ? E.undo[E.undoCount - 1].off + E.undo[E.undoCount - 1].len : 0;
+  if (E.undoCount == E.undoCap)
+  {
+    E.undoCap = E.undoCap ? E.undoCap * 2 : 256;
+    E.undo = realloc(E.undo, sizeof(struct undoRec) * E.undoCap);
+    if (E.undo == NULL)
+      die("realloc");
+  }
+  struct undoRec *r = &E.undo[E.undoCount++];
+  r->op = op;
+  r->flags = join ? UNDO_JOIN : 0;
+  r->row = row;
+  r->col = col;
+  r->cy = E.cy;
+  r->cx = E.cx;
+  r->off = E.undoTextLen;
+  r->len = len;
+  if (len)
+    editorUndoText(len);
+  E.undoPos = E.undoCount;
+  E.undoSealed = 0;
+  return r;
+}
+
+//The last record, if the next edit may still be merged into it
+struct undoRec *editorUndoLast(int op)
+{
+  if (E.undoSealed || E.undoPos == 0 || E.undoPos != E.undoCount)
+    return NULL;
+  struct undoRec *r = &E.undo[E.undoPos - 1];
+  return r->op == op ? r : NULL;
+}
+
+//s was inserted at (row, col); join undoes it together with the record before
+void editorUndoInsert(int row, int col, const char *s, size_t len, int join)
+{
+  struct undoRec *r = join ? NULL : editorUndoLast(UNDO_INSERT);
+  if (r && len == 1 && *s != '\n' && r->row == row && r->col + (int)r->len == col &&
+      E.undoText[r->off + r->len - 1] != '\n')
+  {
+    editorUndoText(1)[0] = *s;
+    r->len++;
+  }
+  else
+  {
+    r = editorUndoAdd(UNDO_INSERT, row, col, len, join);
+    memcpy(&E.undoText[r->off], s, len);
+  }
+  editorUndoTrim();
+}
+
+//len bytes at (row, col) are about to be deleted; backspace when deleting the byte before the cursor
+void editorUndoDelete(int row, int col, size_t len, int backspace)
+{
+  struct undoRec *r = editorUndoLast(UNDO_DELETE);
+  if (r && backspace && len == 1 && (r->flags & UNDO_BACKWARD) && r->row == row && r->col == col + 1)
+  {
+    editorCopyText(row, col, 1, editorUndoText(1));
+    r->col = col;
+    r->len++;
+  }
+  else
+  {
+    r = editorUndoAdd(UNDO_DELETE, row, col, len, 0);
+    if (backspace && len == 1)
+      r->flags |= UNDO_BACKWARD;
+    editorCopyText(row, col, len, &E.undoText[r->off]);
+  }
+  editorUndoTrim();
+}
+
+//Text of a record in file order
+char *editorUndoRecText(struct undoRec *r)
+{
+  char *s = malloc(r->len + 1);
+  if (s == NULL)
+    die("malloc");
+  if (r->flags & UNDO_BACKWARD)
+    for (size_t i = 0; i < r->len; i++)
+      s[i] = E.undoText[r->off + r->len - 1 - i];
+  else
+    memcpy(s, &E.undoText[r->off], r->len);
+  return s;
+}
+
+//Apply a record forwards (redo) or backwards (undo)
+void editorUndoApply(struct undoRec *r, int forward)
+{
+  int op = r->op;
+  int endRow, endCol;
+  if (!forward)
+    op = op == UNDO_INSERT ? UNDO_DELETE : op == UNDO_DELETE ? UNDO_INSERT : op;
+  if (r->op == UNDO_ADDROW)
+  {
+    if (forward)
+      editorInsertRow(r->row, "", 0);
+    else
+      editorDelRow(r->row);
+    return;
+  }
+  if (op == UNDO_DELETE)
+  {
+    editorDeleteText(r->row, r->col, r->len);
+    E.cy = r->row;
+    E.cx = r->col;
+  }
+  else
+  {
+    char *s = editorUndoRecText(r);
+    editorInsertText(r->row, r->col, s, r->len, &endRow, &endCol);
+    free(s);
+    E.cy = endRow;
+    E.cx = endCol;
+  }
+}
+
+void editorUndo()
+{
+  if (E.undoPos == 0)
+  {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+  struct undoRec *r;
+  do
+  {
+    r = &E.undo[--E.undoPos];
+    editorUndoApply(r, 0);
+  } while (E.undoPos > 0 && (r->flags & UNDO_JOIN));
+  E.cy = r->cy;
+  E.cx = r->cx;
+  E.undoSealed = 1;
+  if (E.undoPos == E.undoSaved)
+    E.dirty = 0;
+}
+
+void editorRedo()
+{
+  if (E.undoPos == E.undoCount)
+  {
+    editorSetStatusMessage("Nothing to redo");
+    return;
+  }
+  do
+    editorUndoApply(&E.undo[E.undoPos++], 1);
+  while (E.undoPos < E.undoCount && (E.undo[E.undoPos].flags & UNDO_JOIN));
+  E.undoSealed = 1;
+  if (E.undoPos == E.undoSaved)
+    E.dirty = 0;
+}
+
+/*** editor operations ***/
+void editorInsertChar(int c) 
+{
+  char ch = c;
+  int join = 0;
+  if (E.cy == E.numRows) 
+  {
+    editorUndoAdd(UNDO_ADDROW, E.numRows, 0, 0, 0);
+    editorInsertRow(E.numRows, "", 0);
+    join = 1;
+  }
+  editorUndoInsert(E.cy, E.cx, &ch, 1, join);
+  editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
+  E.cx++;
+}
+
+//Insert a block of text at the cursor as one edit, leaving the cursor after it
+void editorInsertTextAtCursor(const char *s, size_t len)
+{
+  int join = 0;
+  if (len == 0)
+    return;
+  editorUndoSeal();
+  if (E.cy == E.numRows)
+  {
+    editorUndoAdd(UNDO_ADDROW, E.numRows, 0, 0, 0);
+    editorInsertRow(E.numRows, "", 0);
+    join = 1;
+  }
+  editorUndoInsert(E.cy, E.cx, s, len, join);
+  editorInsertText(E.cy, E.cx, s, len, &E.cy, &E.cx);
+  editorUndoSeal();
+}
+
+void editorInsertNewline() 
+{
+  if (E.cy == E.numRows)
+    editorUndoAdd(UNDO_ADDROW, E.cy, 0, 0, 0);
+  else
+    editorUndoInsert(E.cy, E.cx, "\n", 1, 0);
+  if (E.cx == 0) 
+  {
+    editorInsertRow(E.cy, "", 0);
+  }
+  else
+  {
+    erow *row = editorRowAt(E.cy);
+    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+    row = editorRowAt(E.cy);
+    editorRowMaterialize(row);
+    row->size = E.cx;
+    row->chars[row->size] = '\0';
+    editorRowTouch(row, E.cx);
+    editorUpdateRow(row);
+  }
+  E.cy++;
+  E.cx = 0;
+}
+
+void editorDelChar()
+{
+ if(E.cy== E.numRows)
+ {
+  return;
+ }
+ if (E.cx == 0 && E.cy == 0) 
+   return;
+ erow *row = editorRowAt(E.cy);
+ if(E.cx>0)
+ {
+  int prev = editorRowPrevCx(row, E.cx);              //The whole character goes
+  while (E.cx > prev)
+  {
+   editorUndoDelete(E.cy, E.cx - 1, 1, 1);
+   editorRowDelChar(row, E.cx-1);
+   E.cx--;
+  }
+  } 
+  else 
+  {
+    erow *prev = editorRowAt(E.cy - 1);
+    editorUndoDelete(E.cy - 1, prev->size, 1, 1);
+    E.cx = prev->size;
+    editorRowAppendString(prev, row->chars, row->size);
+    editorDelRow(E.cy);
+    E.cy--;
+  }
+}
+
+/*** file i/o ***/
+
+
+/*
+ Loading: the whole file ends up in one buffer (a read-only mapping for big
+ files, a single heap block otherwise) and rows point into it until they are
+ edited. Big files are mapped so that only the rows on screen get rendered
+ and stay resident.
+
+ Newlines are found with a vector compare over the buffer. Files bigger than
+ LOAD_CHUNK_MIN are split into chunks that are indexed on worker threads;
+ each worker records where its lines end and the chunks are then merged into
+ the row table in order.
+*/
+#define LOAD_CHUNK_MIN (16 << 20)
+#define LOAD_CHUNK_MAX (512 << 20)              //Keeps chunk relative offsets within LOAD_END_MASK
+#define LOAD_THREADS_MAX 16
+#define LOAD_CR_SHIFT 29                        //Line ends are stored as offset | (trailing \r count << 29)
+#define LOAD_END_MASK ((1u << LOAD_CR_SHIFT) - 1)
+#define LOAD_CR_MAX 7
+
+struct lineChunk
+{
+  const char *base;                             //Start of the file buffer
+  size_t start;                                 //Chunk offset inside the buffer
+  size_t len;
+  int release;                                  //Give scanned pages back to the kernel
+  uint32_t *ends;                               //Newline offsets relative to start
+  size_t n;
+  size_t cap;
+};
+
+void chunkPushNewline(struct lineChunk *c, size_t off)
+{
+  if (c->n == c->cap)
+  {
+    c->cap = c->cap ? c->cap * 2 : 1024;
+    c->ends = realloc(c->ends, sizeof(uint32_t) * c->cap);
+    if (c->ends == NULL)
+      die("realloc");
+  }
+  //Count the \r in front of the newline while that memory is still hot
+  const char *nl = c->base + c->start + off;
+  uint32_t cr = 0;
+  while (cr < LOAD_CR_MAX && nl - cr > c->base && nl[-1 - (int)cr] == '\r')
+    cr++;
+  c->ends[c->n++] = off | (cr << LOAD_CR_SHIFT);
+}
+
+void scanNewlinesScalar(struct lineChunk *c, size_t off, size_t len)
+{
+  const char *p = c->base + c->start;
+  size_t end = off + len;
+  while (off < end)
+  {
+    const char *nl = memchr(p + off, '\n', end - off);
+    if (nl == NULL)
+      break;
+    chunkPushNewline(c, nl - p);
+    off = nl - p + 1;
+  }
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+void scanNewlinesSSE2(struct lineChunk *c, size_t off, size_t len)
+{
+  const char *p = c->base + c->start;
+  const __m128i nl = _mm_set1_epi8('\n');
+  size_t end = off + len;
+  for (; off + 16 <= end; off += 16)
+  {
+    unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + off)), nl));
+    while (mask)
+    {
+      chunkPushNewline(c, off + __builtin_ctz(mask));
+      mask &= mask - 1;
+    }
+  }
+  scanNewlinesScalar(c, off, end - off);
+}
+
+__attribute__((target("avx2")))
+void scanNewlinesAVX2(struct lineChunk *c, size_t off, size_t len)
+{
+  const char *p = c->base + c->start;
+  const __m256i nl = _mm256_set1_epi8('\n');
+  size_t end = off + len;
+  for (; off + 32 <= end; off += 32)
+  {
+    unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + off)), nl));
+    while (mask)
+    {
+      chunkPushNewline(c, off + __builtin_ctz(mask));
+      mask &= mask - 1;
+    }
+  }
+  scanNewlinesScalar(c, off, end - off);
+}
+#endif
+
+void (*scanNewlines)(struct lineChunk *, size_t, size_t) = scanNewlinesScalar;
+
+//Pick the widest newline kernel this CPU can run
+void selectScanKernel()
+{
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    scanNewlines = scanNewlinesAVX2;
+  else if (__builtin_cpu_supports("sse2"))
+    scanNewlines = scanNewlinesSSE2;
+#endif
+}
+
+void *editorIndexChunk(void *arg)
+{
+  struct lineChunk *c = arg;
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t released = c->start / page * page;
+  size_t off = 0;
+  while (off < c->len)
+  {
+    size_t n = c->len - off;
+    if (n > LAZY_RELEASE_CHUNK)
+      n = LAZY_RELEASE_CHUNK;
+    scanNewlines(c, off, n);
+    off += n;
+    if (c->release)
+    {
+      size_t to = (c->start + off) / page * page;
+      if (to > released)
+      {
+        madvise((char *)c->base + released, to - released, MADV_DONTNEED);
+        released = to;
+      }
+    }
+  }
+  return NULL;
+}
+
+//Append the lines found by one chunk, 'linestart' is where the next line begins
+void editorMergeChunk(struct lineChunk *c, size_t *linestart)
+{
+  for (size_t j = 0; j < c->n; j++)
+  {
+    size_t nl = c->start + (c->ends[j] & LOAD_END_MASK);
+    size_t cr = c->ends[j] >> LOAD_CR_SHIFT;
+    if (cr == LOAD_CR_MAX)
+      while (nl - cr > *linestart && E.map[nl - cr - 1] == '\r')
+        cr++;
+    if (nl - cr < *linestart)
+      cr = nl - *linestart;
+    E.mapCR |= cr != 0;
+    editorInsertMappedRow(E.map + *linestart);
+    *linestart = nl + 1;
+  }
+  free(c->ends);
+  c->ends = NULL;
+}
+
+void editorIndexLines()
+{
+  size_t size = E.mapSize;
+  if (size == 0)
+    return;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t nchunks = size / LOAD_CHUNK_MIN;
+  if (nchunks > (size_t)ncpu)
+    nchunks = ncpu;
+  if (nchunks > LOAD_THREADS_MAX)
+    nchunks = LOAD_THREADS_MAX;
+  if (nchunks < (size + LOAD_CHUNK_MAX - 1) / LOAD_CHUNK_MAX)
+    nchunks = (size + LOAD_CHUNK_MAX - 1) / LOAD_CHUNK_MAX;
+  if (nchunks < 1)
+    nchunks = 1;
+
+  struct lineChunk *chunks = calloc(nchunks, sizeof(struct lineChunk));
+  pthread_t *threads = calloc(nchunks, sizeof(pthread_t));
+  if (chunks == NULL || threads == NULL)
+    die("calloc");
+  size_t per = size / nchunks;
+  for (size_t i = 0; i < nchunks; i++)
+  {
+    chunks[i].base = E.map;
+    chunks[i].start = i * per;
+    chunks[i].len = (i == nchunks - 1) ? size - i * per : per;
+    chunks[i].release = !E.mapHeap;
+  }
+  if (nchunks == 1)
+    editorIndexChunk(&chunks[0]);
+  else
+  {
+    for (size_t i = 0; i < nchunks; i++)
+      if (pthread_create(&threads[i], NULL, editorIndexChunk, &chunks[i]) != 0)
+        die("pthread_create");
+    for (size_t i = 0; i < nchunks; i++)
+      pthread_join(threads[i], NULL);
+  }
+
+  size_t total = 1;
+  for (size_t i = 0; i < nchunks; i++)
+    total += chunks[i].n;
+  editorRowReserve(total);
+  size_t linestart = 0;
+  for (size_t i = 0; i < nchunks; i++)
+    editorMergeChunk(&chunks[i], &linestart);
+  if (linestart < size)                          //Last line without a newline
+  {
+    size_t len = size - linestart;
+    while (len > 0 && E.map[linestart + len - 1] == '\r')
+      len--;
+    E.mapCR |= len < size - linestart;
+    editorInsertMappedRow(E.map + linestart);
+  }
+  free(chunks);
+  free(threads);
+}
+
+//Read a file that is not worth mapping into a single heap buffer
+int editorReadFile(int fd)
+{
+  size_t cap = 0, len = 0;
+  char *buf = NULL;
+  while (1)
+  {
+    if (len == cap)
+    {
+      cap = cap ? cap * 2 : 65536;
+      char *new = realloc(buf, cap);
+      if (new == NULL)
+      {
+        free(buf);
+        return -1;
+      }
+      buf = new;
+    }
+    ssize_t n = read(fd, buf + len, cap - len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1)
+    {
+      free(buf);
+      return -1;
+    }
+    if (n == 0)
+      break;
+    len += n;
+  }
+  E.map = buf;
+  E.mapSize = len;
+  E.mapHeap = 1;
+  return 0;
+}
+
+int editorMapFile(int fd, size_t size)
+{
+  char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return -1;
+  madvise(map, size, MADV_SEQUENTIAL);
+  E.map = map;
+  E.mapSize = size;
+  E.mapHeap = 0;
+  return 0;
+}
+
+//Write out a batch of pieces, carrying on after short writes
+int editorWritev(int fd, struct iovec *iov, int n)
+{
+  while (n > 0)
+  {
+    ssize_t w = writev(fd, iov, n);
+    if (w == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    while (n > 0 && (size_t)w >= iov->iov_len)
+    {
+      w -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0)
+    {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  return 0;
+}
+
+/*
+ Stream the rows to fd without building the file in memory. Runs of
+ untouched rows that are still separated by a bare '\n' in the file buffer
+ go out as one piece, newlines included.
+*/
+int editorWriteRows(int fd, size_t *written)
+{
+  static char newline[] = "\n";
+  struct iovec iov[SAVE_IOV];
+  int n = 0;
+  size_t total = 0;
+  const char *mapEnd = E.map + E.mapSize;
+  for (int j = 0; j < E.numRows; j++)
+  {
+    int size;
+    char *start = editorLineAt(j, &size);
+    char *end = start + size;
+    int hasNewline = 0;
+    if (editorLineMapped(j))
+    {
+      while (end < mapEnd && *end == '\n' && j + 1 < E.numRows && editorLineFollowed(j))
+      {
+        end = editorLineAt(++j, &size);
+        end += size;
+      }
+      if (end < mapEnd && *end == '\n')
+      {
+        end++;
+        hasNewline = 1;
+      }
+    }
+    iov[n].iov_base = start;
+    iov[n++].iov_len = end - start;
+    if (!hasNewline)
+    {
+      iov[n].iov_base = newline;
+      iov[n++].iov_len = 1;
+    }
+    total += end - start + !hasNewline;
+    if (n > SAVE_IOV - 2)
+    {
+      if (editorWritev(fd, iov, n) == -1)
+        return -1;
+      n = 0;
+    }
+  }
+  if (editorWritev(fd, iov, n) == -1)
+    return -1;
+  *written = total;
+  return 0;
+}
+
+//Make a rename in the directory of path durable
+void editorSyncDir(const char *path)
+{
+  const char *slash = strrchr(path, '/');
+  char *dir = slash ? strndup(path, slash == path ? 1 : (size_t)(slash - path)) : strdup(".");
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (fd != -1)
+  {
+    fsync(fd);
+    close(fd);
+  }
+  free(dir);
+}
+
+/*
+ Saving in place. While no rows have been inserted or deleted and every
+ edited row still has its original length, the file on disk has the same
+ layout as the buffer and only the edited rows need to be written back, at
+ the offsets they were loaded from. The new bytes first go into a journal
+ next to the file and are then patched in with pwrite(); if that is
+ interrupted the journal is replayed the next time the file is opened.
+
+ Journal: "KILOJNL2", the file size and inode, then for every patch its
+ offset, length, new bytes and the bytes it replaces, and finally an offset
+ of UINT64_MAX followed by a checksum of everything before it. A journal is
+ only replayed onto the same inode, and only while every patched byte is
+ still either its old or its new value; otherwise the file was written some
+ other way since and the journal is stale.
+*/
+#define JOURNAL_MAGIC "KILOJNL2"
+#define JOURNAL_END UINT64_MAX
+
+uint64_t journalSum(uint64_t h, const void *p, size_t len)
+{
+  const unsigned char *s = p;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ s[i]) * 0x100000001b3ULL;                        //FNV-1a
+  return h;
+}
+
+char *editorJournalName(const char *path)
+{
+  char *name = malloc(strlen(path) + 9);
+  if (name == NULL)
+    die("malloc");
+  sprintf(name, "%s.journal", path);
+  return name;
+}
+
+int editorPread(int fd, char *s, size_t len, off_t off)
+{
+  while (len > 0)
+  {
+    ssize_t n = pread(fd, s, len, off);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    s += n;
+    len -= n;
+    off += n;
+  }
+  return 0;
+}
+
+int editorPwrite(int fd, const char *s, size_t len, off_t off)
+{
+  while (len > 0)
+  {
+    ssize_t n = pwrite(fd, s, len, off);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    s += n;
+    len -= n;
+    off += n;
+  }
+  return 0;
+}
+
+//Finish a save that was interrupted after its journal was written, returns whether there was one
+int editorRecoverJournal(const char *filename)
+{
+  char *path = realpath(filename, NULL);
+  if (path == NULL)
+    return 0;
+  char *jname = editorJournalName(path);
+  int jfd = open(jname, O_RDONLY);
+  int recovered = 0;
+  if (jfd != -1)
+  {
+    struct stat jst, st;
+    char *j = NULL, *cur = NULL;
+    int valid = fstat(jfd, &jst) == 0 && stat(path, &st) == 0 && jst.st_size >= 40 &&
+      (j = malloc(jst.st_size)) != NULL && read(jfd, j, jst.st_size) == jst.st_size;
+    close(jfd);
+    uint64_t fileSize, ino, off = 0, len;
+    size_t at = 24;
+    if (valid)
+    {
+      memcpy(&fileSize, j + 8, 8);
+      memcpy(&ino, j + 16, 8);
+      valid = !memcmp(j, JOURNAL_MAGIC, 8) && fileSize == (uint64_t)st.st_size && ino == (uint64_t)st.st_ino;
+    }
+    //Walk the patches once to check the journal is complete
+    while (valid)
+    {
+      if (at + 16 > (size_t)jst.st_size)
+      {
+        valid = 0;
+        break;
+      }
+      memcpy(&off, j + at, 8);
+      memcpy(&len, j + at + 8, 8);
+      if (off == JOURNAL_END)
+      {
+        valid = len == journalSum(0xcbf29ce484222325ULL, j, at);
+        break;
+      }
+      if (len > (jst.st_size - at - 16) / 2 || off + len > fileSize)
+        valid = 0;
+      at += 16 + 2 * len;
+    }
+    int fd = valid ? open(path, O_RDWR) : -1;
+    //Every patched byte has to be its old or its new value
+    if (fd != -1 && (cur = malloc(jst.st_size)) == NULL)
+      die("malloc");
+    for (at = 24; fd != -1 && valid; at += 16 + 2 * len)
+    {
+      memcpy(&off, j + at, 8);
+      memcpy(&len, j + at + 8, 8);
+      if (off == JOURNAL_END)
+        break;
+      const char *new = j + at + 16, *old = new + len;
+      valid = editorPread(fd, cur, len, off) == 0;
+      for (uint64_t i = 0; valid && i < len; i++)
+        valid = cur[i] == new[i] || cur[i] == old[i];
+    }
+    if (fd != -1 && valid)
+    {
+      at = 24;
+      while (1)
+      {
+        memcpy(&off, j + at, 8);
+        memcpy(&len, j + at + 8, 8);
+        if (off == JOURNAL_END || editorPwrite(fd, j + at + 16, len, off) == -1)
+          break;
+        at += 16 + 2 * len;
+      }
+      recovered = off == JOURNAL_END && fsync(fd) == 0;
+    }
+    if (fd != -1)
+      close(fd);
+    free(cur);
+    free(j);
+    //A journal that is not complete was never acted on and a stale one no longer applies
+    if (recovered || !valid)
+      unlink(jname);
+  }
+  free(jname);
+  free(path);
+  return recovered;
+}
+
+//Write the rows edited since the last save over their old bytes; returns 0 if the file has to be written out in full
+int editorSaveInPlace(const char *path)
+{
+  if (!E.inPlace || E.rowsMoved)
+    return 0;
+  struct stat st;
+  if (stat(path, &st) == -1 || st.st_dev != E.diskStat.st_dev || st.st_ino != E.diskStat.st_ino ||
+      st.st_size != E.diskStat.st_size || st.st_mtim.tv_sec != E.diskStat.st_mtim.tv_sec ||
+      st.st_mtim.tv_nsec != E.diskStat.st_mtim.tv_nsec)
+    return 0;
+  int patches = 0;
+  size_t bytes = 0;
+  for (int i = 0; i < E.originCount; i++)
+  {
+    erow *row = editorRowAt(E.origins[i].row);
+    if (!(row->flags & ROW_DIRTY))
+      continue;
+    if (row->size != E.origins[i].size)
+      return 0;
+    patches++;
+    bytes += row->size;
+  }
+  if (patches == 0)
+  {
+    editorUndoMarkSaved();
+    editorSetStatusMessage("No changes to write");
+    return 1;
+  }
+
+  char *jname = editorJournalName(path);
+  //The bytes the patches replace go into the journal too, so that it can tell a file changed since
+  int fd = open(path, O_RDWR);
+  int jfd = -1, patching = 0;
+  size_t written = 0;
+  int ok = fd != -1;
+  char *old = malloc(bytes ? bytes : 1), *o = old;
+  if (old == NULL)
+    die("malloc");
+  for (int i = 0; ok && i < E.originCount; i++)
+    if (editorRowAt(E.origins[i].row)->flags & ROW_DIRTY)
+    {
+      ok = editorPread(fd, o, E.origins[i].size, E.origins[i].off) == 0;
+      o += E.origins[i].size;
+    }
+  if (ok)
+    ok = (jfd = open(jname, O_WRONLY | O_CREAT | O_TRUNC, 0600)) != -1;
+  uint64_t head[3], sum;
+  struct iovec iov[SAVE_IOV];
+  uint64_t (*hdr)[2] = malloc(sizeof(uint64_t[2]) * (patches + 1));
+  if (hdr == NULL)
+    die("malloc");
+  memcpy(head, JOURNAL_MAGIC, 8);
+  head[1] = st.st_size;
+  head[2] = st.st_ino;
+  sum = journalSum(0xcbf29ce484222325ULL, head, 24);
+  ok = ok && editorWritev(jfd, &(struct iovec){head, 24}, 1) == 0;
+  int n = 0, k = 0;
+  o = old;
+  for (int i = 0; ok && i < E.originCount; i++)
+  {
+    erow *row = editorRowAt(E.origins[i].row);
+    if (!(row->flags & ROW_DIRTY))
+      continue;
+    hdr[k][0] = E.origins[i].off;
+    hdr[k][1] = row->size;
+    sum = journalSum(sum, hdr[k], 16);
+    sum = journalSum(sum, row->chars, row->size);
+    sum = journalSum(sum, o, row->size);
+    iov[n].iov_base = hdr[k++];
+    iov[n++].iov_len = 16;
+    iov[n].iov_base = row->chars;
+    iov[n++].iov_len = row->size;
+    iov[n].iov_base = o;
+    iov[n++].iov_len = row->size;
+    o += row->size;
+    if (n > SAVE_IOV - 3)
+    {
+      ok = editorWritev(jfd, iov, n) == 0;
+      n = 0;
+    }
+  }
+  hdr[k][0] = JOURNAL_END;
+  hdr[k][1] = sum;
+  iov[n].iov_base = hdr[k];
+  iov[n++].iov_len = 16;
+  ok = ok && editorWritev(jfd, iov, n) == 0;
+  ok = ok && (E.saveFsync < 1 || fsync(jfd) == 0);
+  if (jfd != -1 && close(jfd) == -1)
+    ok = 0;
+
+  //The journal is safe, now patch the file itself
+  patching = ok;
+  for (int i = 0; ok && i < E.originCount; i++)
+  {
+    erow *row = editorRowAt(E.origins[i].row);
+    if (!(row->flags & ROW_DIRTY))
+      continue;
+    ok = editorPwrite(fd, row->chars, row->size, E.origins[i].off) == 0;
+    written += row->size;
+  }
+  ok = ok && (E.saveFsync < 1 || fsync(fd) == 0);
+  ok = ok && fstat(fd, &E.diskStat) == 0;
+  if (fd != -1 && close(fd) == -1)
+    ok = 0;
+  free(hdr);
+  free(old);
+
+  if (ok)
+  {
+    unlink(jname);
+    for (int i = 0; i < E.originCount; i++)
+      editorRowAt(E.origins[i].row)->flags &= ~ROW_DIRTY;
+    editorUndoMarkSaved();
+    editorSetStatusMessage("%zu bytes in %d lines written in place", written, patches);
+  }
+  else
+  {
+    int err = errno;
+    //If the journal made it to disk it is replayed on the next open; a full save removes it
+    if (!patching)
+      unlink(jname);
+    E.inPlace = 0;
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(err));
+  }
+  free(jname);
+  return 1;
+}
+
+void editorOpen(char *filename)
+ {
+  free(E.filename);
+  E.filename = strdup(filename);
+
+  editorSelectSyntaxHighlight();
+
+  int recovered = editorRecoverJournal(filename);
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    die("open");
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    die("fstat");
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if (!(S_ISREG(st.st_mode) && st.st_size >= LAZY_OPEN_MIN && editorMapFile(fd, st.st_size) == 0) &&
+      editorReadFile(fd) == -1)
+    die("read");
+  close(fd);
+
+  editorIndexLines();
+  if (!E.mapHeap)
+    madvise(E.map, E.mapSize, MADV_RANDOM);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  if (secs <= 0)
+    secs = 1e-9;
+  if (E.mapSize >= LAZY_OPEN_MIN)
+    editorSetStatusMessage("Loaded %d lines in %.2fs: %.2f Mlines/s, %.1f MB/s",
+      E.numRows, secs, E.numRows / secs / 1e6, E.mapSize / secs / 1e6);
+  if (recovered)
+    editorSetStatusMessage("Finished writing an interrupted save");
+  E.dirty=0;
+
+  //A full save adds the final newline and drops \r, in place the rest of the file would keep them
+  E.diskStat = st;
+  E.inPlace = S_ISREG(st.st_mode) && !E.mapCR && E.mapSize > 0 && E.map[E.mapSize - 1] == '\n';
+  E.rowsMoved = 0;
+  E.originCount = 0;
+}
+
+void editorSave()                     //Function to save the edited file
+{
+  if (E.filename == NULL) 
+  {
+    E.filename = editorPrompt("Save as: %s (ESC to cancel)",NULL);
+    if (E.filename == NULL) 
+    {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntaxHighlight();
+  }
+  /*
+   The rows are streamed into a new file next to the old one, which is then
+   renamed over it, so a crash or a full disk leaves either the old file or
+   the new one and never a mix. Untouched rows still point into the mapping
+   of the old file; that keeps working after the rename.
+  */
+  char *target = realpath(E.filename, NULL);                  //Save through symlinks
+  const char *path = target ? target : E.filename;
+  if (editorSaveInPlace(path))
+  {
+    free(target);
+    return;
+  }
+  char *tmpname = malloc(strlen(path) + 8);
+  if (tmpname == NULL)
+    die("malloc");
+  sprintf(tmpname, "%s.XXXXXX", path);
+  struct stat st;
+  int exists = stat(path, &st) == 0;
+  size_t len = 0;
+  int fd = mkstemp(tmpname);                    //A new file of ours, never one already there or a symlink
+  int ok = fd != -1;
+  if (ok)
+  {
+    mode_t mask = umask(0);
+    umask(mask);
+    ok = fchmod(fd, exists ? (st.st_mode & 07777) : (0644 & ~mask)) == 0;
+  }
+  ok = ok && editorWriteRows(fd, &len) == 0;
+  ok = ok && (E.saveFsync < 1 || fsync(fd) == 0);
+  if (fd != -1 && close(fd) == -1)
+    ok = 0;
+  ok = ok && rename(tmpname, path) == 0;
+  if (ok && E.saveFsync >= 2)
+    editorSyncDir(path);
+  if (ok)
+  {
+    editorUndoMarkSaved();
+    editorSetStatusMessage("%zu bytes written to disk", len);
+    //The file on disk no longer matches the buffer the rows point into
+    E.inPlace = 0;
+    E.originCount = 0;
+    char *jname = editorJournalName(path);
+    unlink(jname);
+    free(jname);
+  }
+  else
+  {
+    int err = errno;
+    if (fd != -1)
+      unlink(tmpname);
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(err));
+  }
+  free(tmpname);
+  free(target);
+}
+
+/*** find ***/
+
+void finderInit(struct finder *f, const char *q, size_t len)
+{
+  f->q = realloc(f->q, len + 1);
+  if (f->q == NULL)
+    die("realloc");
+  memcpy(f->q, q, len + 1);
+  f->len = len;
+  size_t i;
+  for (i = 0; i < 256; i++)
+    f->shift[i] = len;
+  for (i = 0; i + 1 < len; i++)
+    f->shift[(unsigned char)q[i]] = len - 1 - i;
+}
+
+const char *findScalar(const struct finder *f, const char *s, size_t n)
+{
+  size_t len = f->len;
+  if (len == 0 || n < len)
+    return NULL;
+  if (len == 1)
+    return memchr(s, f->q[0], n);
+  unsigned char last = f->q[len - 1];
+  size_t i = 0;
+  while (i <= n - len)
+  {
+    unsigned char c = s[i + len - 1];
+    if (c == last && !memcmp(s + i, f->q, len - 1))
+      return s + i;
+    i += f->shift[c];
+  }
+  return NULL;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+const char *findSSE2(const struct finder *f, const char *s, size_t n)
+{
+  size_t len = f->len;
+  if (len < 2 || n < len)
+    return findScalar(f, s, n);
+  const __m128i first = _mm_set1_epi8(f->q[0]);
+  const __m128i last = _mm_set1_epi8(f->q[len - 1]);
+  size_t i;
+  for (i = 0; i + len - 1 + 16 <= n; i += 16)
+  {
+    __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + i)), first);
+    __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + i + len - 1)), last);
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(a, b));
+    while (mask)
+    {
+      size_t j = i + __builtin_ctz(mask);
+      if (!memcmp(s + j + 1, f->q + 1, len - 2))
+        return s + j;
+      mask &= mask - 1;
+    }
+  }
+  return findScalar(f, s + i, n - i);
+}
+
+__attribute__((target("avx2")))
+const char *findAVX2(const struct finder *f, const char *s, size_t n)
+{
+  size_t len = f->len;
+  if (len < 2 || n < len)
+    return findScalar(f, s, n);
+  const __m256i first = _mm256_set1_epi8(f->q[0]);
+  const __m256i last = _mm256_set1_epi8(f->q[len - 1]);
+  size_t i;
+  for (i = 0; i + len - 1 + 32 <= n; i += 32)
+  {
+    __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(s + i)), first);
+    __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(s + i + len - 1)), last);
+    unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(a, b));
+    while (mask)
+    {
+      size_t j = i + __builtin_ctz(mask);
+      if (!memcmp(s + j + 1, f->q + 1, len - 2))
+        return s + j;
+      mask &= mask - 1;
+    }
+  }
+  return findScalar(f, s + i, n - i);
+}
+#endif
+
+const char *(*findKernel)(const struct finder *, const char *, size_t) = findScalar;
+
+void selectFindKernel()
+{
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    findKernel = findAVX2;
+  else if (__builtin_cpu_supports("sse2"))
+    findKernel = findSSE2;
+#endif
+}
+
+/*
+ Rows still in the file buffer are searched as one block of text instead of
+ row by row. The query never contains a newline, so a match can't run from
+ one row into the next.
+*/
+#define FIND_BLOCK (4 << 20)
+#define FIND_BLOCK_FIRST (4 << 10)              //Stepping to the next match starts with blocks this big
+
+//End of the block of contiguous rows starting at 'at', at most 'to' and about max bytes
+int editorFindBlockEnd(int at, int to, long max)
+{
+  int size;
+  const char *start = editorLineAt(at, &size);
+  const char *last = start + size;
+  int end = at + 1;
+  while (end < to && last - start < max && editorLineFollowed(end - 1))
+  {
+    last = editorLineAt(end, &size);
+    last += size;
+    end++;
+  }
+  return end;
+}
+
+//Start of the block of contiguous rows ending at 'at', at least 'to'
+int editorFindBlockStart(int at, int to)
+{
+  int size;
+  const char *end = editorLineAt(at, &size);
+  end += size;
+  int start = at;
+  while (start > to && end - editorLineStart(start) < FIND_BLOCK && editorLineFollowed(start - 1))
+    start--;
+  return start;
+}
+
+//Row in [from, to) of a block whose text contains m
+int editorFindBlockRow(int from, int to, const char *m)
+{
+  while (to - from > 1)
+  {
+    int mid = from + (to - from) / 2;
+    if (editorLineStart(mid) <= m)
+      from = mid;
+    else
+      to = mid;
+  }
+  return from;
+}
+
+/*
+ First match in rows [from, to), starting at column col of row from. Blocks
+ start small and double, so finding a match close by doesn't first walk the
+ rows of a whole FIND_BLOCK.
+*/
+int editorFindForward(struct finder *f, int from, int to, int col, int *row, int *cx)
+{
+  long block = FIND_BLOCK_FIRST;
+  while (from < to)
+  {
+    int end = editorFindBlockEnd(from, to, block);
+    if (block < FIND_BLOCK)
+      block *= 2;
+    int size;
+    const char *s = editorLineAt(from, &size);
+    if (col > size)
+      col = size;
+    s += col;
+    const char *e = editorLineAt(end - 1, &size);
+    const char *m = findKernel(f, s, e + size - s);
+    if (m)
+    {
+      *row = editorFindBlockRow(from, end, m);
+      *cx = m - editorLineStart(*row);
+      return 1;
+    }
+    from = end;
+    col = 0;
+  }
+  return 0;
+}
+
+//Last match in rows from down to to, starting before column col of row from
+int editorFindBackward(struct finder *f, int from, int to, int col, int *row, int *cx)
+{
+  while (from >= to)
+  {
+    int start = editorFindBlockStart(from, to), size;
+    const char *limit = editorLineAt(from, &size);
+    const char *end = limit + size;
+    if (col > size)
+      col = size;
+    limit += col;
+    const char *m = NULL;
+    const char *p = editorLineStart(start);
+    while (p < limit && (p = findKernel(f, p, end - p)) != NULL && p < limit)
+      m = p++;
+    if (m)
+    {
+      *row = editorFindBlockRow(start, from + 1, m);
+      *cx = m - editorLineStart(*row);
+      return 1;
+    }
+    from = start - 1;
+    col = INT_MAX;
+  }
+  return 0;
+}
+
+//First match in line at at or after column from, -1 if none
+int editorLineNextMatch(int at, int from, int *len)
+{
+  int size;
+  const char *chars = editorLineAt(at, &size);
+  if (E.findRegex)
+    return reSearch(E.regex, E.reCache, chars, size, from, len);
+  if (from > size)
+    return -1;
+  const char *m = findKernel(&E.finder, chars + from, size - from);
+  *len = E.finder.len;
+  return m ? m - chars : -1;
+}
+
+/*
+ Where to look for the next match of a row after one at cx: literal matches
+ may overlap, a regex match is searched for again only past its end, which
+ keeps finding all of them linear in the row.
+*/
+int editorMatchResume(int cx, int len)
+{
+  return E.findRegex && len ? cx + len : cx + 1;
+}
+
+//First regex match in rows [from, to), starting at column col of row from
+int editorRegexForward(struct reCache *c, int from, int to, int col, int *row, int *cx, int *len)
+{
+  struct finder *prefix = rePrefix(E.regex);
+  while (from < to)
+  {
+    //Rows without the literal every match starts with are skipped a block at a time
+    if (prefix && !editorFindForward(prefix, from, to, col, &from, &col))
+      return 0;
+    int size;
+    const char *chars = editorLineAt(from, &size);
+    int m = reSearch(E.regex, c, chars, size, col, len);
+    if (m >= 0)
+    {
+      *row = from;
+      *cx = m;
+      return 1;
+    }
+    from++;
+    col = 0;
+  }
+  return 0;
+}
+
+//Last regex match in rows from down to to, starting before column col of row from
+int editorRegexBackward(struct reCache *c, int from, int to, int col, int *row, int *cx, int *len)
+{
+  for (; from >= to; from--, col = INT_MAX)
+  {
+    int m, l, best = -1, size;
+    const char *chars = editorLineAt(from, &size);
+    for (m = reSearch(E.regex, c, chars, size, 0, &l); m >= 0 && m < col;
+         m = reSearch(E.regex, c, chars, size, editorMatchResume(m, l), &l))
+    {
+      best = m;
+      *len = l;
+    }
+    if (best >= 0)
+    {
+      *row = from;
+      *cx = best;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ Find all: every match of the query, in file order, so that the status bar
+ can show "match k of N" and next/previous are a binary search away. Rows are
+ split between threads that each collect the matches of their part. Queries
+ with more than FIND_MAX_MATCHES matches aren't indexed and are stepped
+ through with editorFindForward/editorFindBackward instead.
+*/
+#define FIND_MAX_MATCHES (1 << 22)
+#define FIND_ROWS_PER_THREAD 65536
+
+struct findJob
+{
+  int from;
+  int to;
+  struct matchPos *m;
+  int n;
+  int cap;
+  int *total;                                   //Matches found by all jobs so far
+};
+
+void findJobPush(struct findJob *job, int row, int cx, int len)
+{
+  if (job->n == job->cap)
+  {
+    job->cap = job->cap ? job->cap * 2 : 256;
+    job->m = realloc(job->m, sizeof(struct matchPos) * job->cap);
+    if (job->m == NULL)
+      die("realloc");
+  }
+  job->m[job->n].row = row;
+  job->m[job->n].cx = cx;
+  job->m[job->n].len = len;
+  job->n++;
+}
+
+void *editorFindAllJob(void *arg)
+{
+  struct findJob *job = arg;
+  struct finder *f = &E.finder;
+  int from = job->from;
+  if (E.findRegex)
+  {
+    struct reCache *c = reCacheNew(E.regex);
+    int col = 0, cx, len;
+    while (__atomic_load_n(job->total, __ATOMIC_RELAXED) <= FIND_MAX_MATCHES &&
+           editorRegexForward(c, from, job->to, col, &from, &cx, &len))
+    {
+      findJobPush(job, from, cx, len);
+      __atomic_add_fetch(job->total, 1, __ATOMIC_RELAXED);
+      col = editorMatchResume(cx, len);
+    }
+    reCacheFree(c);
+    return NULL;
+  }
+  while (from < job->to && __atomic_load_n(job->total, __ATOMIC_RELAXED) <= FIND_MAX_MATCHES)
+  {
+    int end = editorFindBlockEnd(from, job->to, FIND_BLOCK);
+    const char *p = editorLineStart(from), *e;
+    int size, n = job->n;
+    int row = from;
+    e = editorLineAt(end - 1, &size);
+    e += size;
+    while ((p = findKernel(f, p, e - p)) != NULL)
+    {
+      while (row + 1 < end && editorLineStart(row + 1) <= p)
+        row++;
+      findJobPush(job, row, p - editorLineStart(row), f->len);
+      p++;
+    }
+    __atomic_add_fetch(job->total, job->n - n, __ATOMIC_RELAXED);
+    from = end;
+  }
+  return NULL;
+}
+
+//Index every match of E.finder, leaves matchValid 0 if there are too many
+void editorFindAll()
+{
+  E.matchCount = 0;
+  E.matchValid = 0;
+  E.matchCur = -1;
+  E.matchFrom = -1;
+  if (E.finder.len == 0 || E.numRows == 0 || (E.findRegex && E.regex == NULL))
+    return;
+
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int njobs = E.numRows / FIND_ROWS_PER_THREAD + 1;
+  if (njobs > ncpu)
+    njobs = ncpu > 0 ? ncpu : 1;
+  struct findJob *jobs = calloc(njobs, sizeof(struct findJob));
+  pthread_t *threads = calloc(njobs, sizeof(pthread_t));
+  if (jobs == NULL || threads == NULL)
+    die("calloc");
+  int total = 0;
+  int per = E.numRows / njobs;
+  for (int i = 0; i < njobs; i++)
+  {
+    jobs[i].from = i * per;
+    jobs[i].to = (i == njobs - 1) ? E.numRows : (i + 1) * per;
+    jobs[i].total = &total;
+  }
+  if (njobs == 1)
+    editorFindAllJob(&jobs[0]);
+  else
+  {
+    for (int i = 0; i < njobs; i++)
+      if (pthread_create(&threads[i], NULL, editorFindAllJob, &jobs[i]) != 0)
+        die("pthread_create");
+    for (int i = 0; i < njobs; i++)
+      pthread_join(threads[i], NULL);
+  }
+
+  if (total <= FIND_MAX_MATCHES)
+  {
+    if (E.matchCap < total)
+    {
+      free(E.matches);
+      E.matches = malloc(sizeof(struct matchPos) * total);
+      if (E.matches == NULL)
+        die("malloc");
+      E.matchCap = total;
+    }
+    for (int i = 0; i < njobs; i++)
+      if (jobs[i].n)
+      {
+        memcpy(&E.matches[E.matchCount], jobs[i].m, sizeof(struct matchPos) * jobs[i].n);
+        E.matchCount += jobs[i].n;
+      }
+    E.matchValid = 1;
+  }
+  for (int i = 0; i < njobs; i++)
+    free(jobs[i].m);
+  free(jobs);
+  free(threads);
+}
+
+//The query got longer: keep the matches that still match, without searching again
+void editorFindNarrow()
+{
+  struct finder *f = &E.finder;
+  int n = 0;
+  for (int i = 0; i < E.matchCount; i++)
+  {
+    int size;
+    const char *chars = editorLineAt(E.matches[i].row, &size);
+    if (size - E.matches[i].cx >= (int)f->len &&
+        !memcmp(chars + E.matches[i].cx, f->q, f->len))
+    {
+      E.matches[n] = E.matches[i];
+      E.matches[n++].len = f->len;
+    }
+  }
+  E.matchCount = n;
+}
+
+//Index of the first match at or after (row, cx)
+int editorMatchAt(int row, int cx)
+{
+  int lo = 0, hi = E.matchCount;
+  while (lo < hi)
+  {
+    int mid = lo + (hi - lo) / 2;
+    struct matchPos *m = &E.matches[mid];
+    if (m->row < row || (m->row == row && m->cx < cx))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+void editorMatchesReserve(int n)
+{
+  if (E.matchCount + n <= E.matchCap)
+    return;
+  int cap = E.matchCap ? E.matchCap : 256;
+  while (cap < E.matchCount + n)
+    cap *= 2;
+  E.matches = realloc(E.matches, sizeof(struct matchPos) * cap);
+  if (E.matches == NULL)
+    die("realloc");
+  E.matchCap = cap;
+}
+
+#ifdef MATCH_CHECK
+/*
+ Built with -DMATCH_CHECK, the index is compared with one found from scratch
+ whenever it is used, stopping at the first difference.
+*/
+void editorMatchesCheck()
+{
+  int n = E.matchCount, cur = E.matchCur;
+  struct matchPos *kept = malloc(sizeof(struct matchPos) * (n ? n : 1));
+  if (kept == NULL)
+    die("malloc");
+  if (n)
+    memcpy(kept, E.matches, sizeof(struct matchPos) * n);
+  editorFindAll();
+  if (E.matchValid && (E.matchCount != n || (n && memcmp(kept, E.matches, sizeof(struct matchPos) * n))))
+    die("match index out of date");
+  E.matchCur = cur;
+  free(kept);
+}
+#endif
+
+/*
+ Edits don't search the rows they change right away. The rows are gathered
+ into one range, and when the index is next used or an edit lands away from
+ that range, the range is searched once and the matches after it are moved
+ once. Typing into a row, however long, then costs nothing per key, and a
+ paste of many rows renumbers the matches below it a single time.
+*/
+void editorMatchesSync()
+{
+  static struct findJob found;                  //Matches of the range, reused
+  if (E.matchFrom < 0)
+    return;
+  int from = E.matchFrom, to = E.matchTo, shift = E.matchShift;
+  E.matchFrom = -1;
+  if (!E.matchValid)
+    return;
+  found.n = 0;
+  for (int at = from; at < to; at++)
+  {
+    int cx, len;
+    for (cx = editorLineNextMatch(at, 0, &len); cx >= 0; cx = editorLineNextMatch(at, editorMatchResume(cx, len), &len))
+      findJobPush(&found, at, cx, len);
+  }
+  //Rows up to the range kept their numbers, so it starts at from in the index too
+  int lo = editorMatchAt(from, 0);
+  int hi = editorMatchAt(to - shift, 0);
+  if (E.matchCount - (hi - lo) + found.n > FIND_MAX_MATCHES)
+  {
+    E.matchValid = 0;
+    E.matchCur = -1;
+    return;
+  }
+  editorMatchesReserve(found.n - (hi - lo));
+  if (hi < E.matchCount)
+    memmove(&E.matches[lo + found.n], &E.matches[hi], sizeof(struct matchPos) * (E.matchCount - hi));
+  E.matchCount += found.n - (hi - lo);
+  if (found.n)
+    memcpy(&E.matches[lo], found.m, sizeof(struct matchPos) * found.n);
+  if (shift)
+    for (int i = lo + found.n; i < E.matchCount; i++)
+      E.matches[i].row += shift;
+}
+
+//Bring the index up to date before it is used
+void editorMatchesReady()
+{
+  editorMatchesSync();
+#ifdef MATCH_CHECK
+  editorMatchesCheck();
+#endif
+}
+
+//Row at changed (rows 0), is about to be inserted (1) or deleted (-1)
+void editorMatchesEdit(int at, int rows)
+{
+  if (E.matchFrom >= 0 && (at < E.matchFrom - 1 || at > E.matchTo))
+    editorMatchesSync();
+  if (E.matchFrom < 0)
+  {
+    E.matchFrom = E.matchTo = at;
+    E.matchShift = 0;
+  }
+  if (at < E.matchFrom)
+    E.matchFrom = at;
+  if (rows <= 0 && E.matchTo < at + 1)
+    E.matchTo = at + 1;
+  else if (rows > 0 && E.matchTo < at)
+    E.matchTo = at;
+  E.matchTo += rows;
+  E.matchShift += rows;
+}
+
+//Show match k of the index
+void editorShowMatch(int k)
+{
+  struct matchPos *m = &E.matches[k];
+  erow *row = editorRowAt(m->row);
+  E.matchCur = k;
+  E.cy = m->row;
+  E.cx = m->cx;
+  E.rowoff = E.numRows;
+  E.findRow = m->row;
+  E.findRx = editorRowCxToRx(row, m->cx);
+  E.findLen = editorRowCxToRx(row, m->cx + m->len) - E.findRx;
+}
+
+char findPrompt[64] = "Search: %s (Use ESC/Arrows/Enter, Ctrl-R: regex)";
+
+void editorCompileRegex(const char *query)
+{
+  reFree(E.regex);
+  reCacheFree(E.reCache);
+  E.regex = reCompile(query);
+  E.reCache = E.regex ? reCacheNew(E.regex) : NULL;
+}
+
+void editorFindCallback(char *query, int key) 
+{
+  static int last_row = -1;
+  static int last_cx = 0;
+  struct finder *f = &E.finder;
+  size_t len = strlen(query);
+  int row = last_row, cx = last_cx;
+  int mlen = len;
+  int found;
+
+  editorMatchesReady();
+  E.findRow = -1;
+  if (key == CNTRL_KEY('r'))
+  {
+    E.findRegex = !E.findRegex;
+    snprintf(findPrompt, sizeof(findPrompt), "%s: %%s (Use ESC/Arrows/Enter, Ctrl-R: %s)",
+      E.findRegex ? "Regex" : "Search", E.findRegex ? "literal" : "regex");
+  }
+ 
+  if (key == '\r' || key == '\x1b' || len == 0) 
+  {
+    //Enter keeps the query and its matches for Ctrl-N/Ctrl-P
+    if (key != '\r')
+    {
+      f->len = 0;
+      E.matchValid = 0;
+    }
+    E.matchCur = -1;
+    last_row = -1;
+    return;
+  }
+  if (E.numRows == 0)
+    return;
+  int backward = key == ARROW_LEFT || key == ARROW_UP;
+  if (key == ARROW_RIGHT || key == ARROW_DOWN)
+  {
+    cx++;
+  }
+  else if (!backward)
+  {
+    //Every match of a longer query is a match of the old one, so narrow from the last match
+    int longer = f->len && len >= f->len && !memcmp(query, f->q, f->len);
+    if (key == CNTRL_KEY('r'))
+      longer = 0;
+    if (!longer || E.findRegex)
+      row = -1;
+    finderInit(f, query, len);
+    if (E.findRegex)
+      editorCompileRegex(query);
+    if (longer && E.matchValid && !E.findRegex)
+      editorFindNarrow();
+    else
+      editorFindAll();
+    if (E.findRegex && E.regex == NULL)
+      return;
+  }
+  if (row == -1)
+  {
+    row = backward ? E.numRows - 1 : 0;
+    cx = backward ? INT_MAX : 0;
+  }
+
+  if (E.matchValid)
+  {
+    if (E.matchCount == 0)
+      return;
+    int k = editorMatchAt(row, cx);
+    if (backward)
+      k = (k + E.matchCount - 1) % E.matchCount;
+    else if (k == E.matchCount)
+      k = 0;
+    editorShowMatch(k);
+    last_row = E.cy;
+    last_cx = E.cx;
+    return;
+  }
+
+  int at = row;
+  if (E.findRegex && backward)
+    found = editorRegexBackward(E.reCache, at, 0, cx, &row, &cx, &mlen) ||
+      editorRegexBackward(E.reCache, E.numRows - 1, at, INT_MAX, &row, &cx, &mlen);
+  else if (E.findRegex)
+    found = editorRegexForward(E.reCache, at, E.numRows, cx, &row, &cx, &mlen) ||
+      editorRegexForward(E.reCache, 0, at + 1, 0, &row, &cx, &mlen);
+  else if (backward)
+    found = editorFindBackward(f, at, 0, cx, &row, &cx) ||
+      editorFindBackward(f, E.numRows - 1, at, INT_MAX, &row, &cx);
+  else
+    found = editorFindForward(f, at, E.numRows, cx, &row, &cx) ||
+      editorFindForward(f, 0, at + 1, 0, &row, &cx);
+
+  if (found) 
+  {
+    erow *match = editorRowAt(row);
+    last_row = row;
+    last_cx = cx;
+    E.cy = row;
+    E.cx = cx;
+    E.rowoff = E.numRows;
+
+    E.findRow = row;
+    E.findRx = editorRowCxToRx(match, cx);
+    E.findLen = editorRowCxToRx(match, cx + mlen) - E.findRx;
+  }
+}
+
+//Ctrl-N/Ctrl-P: jump to the next or previous match of the last search from the cursor
+void editorFindNext(int dir)
+{
+  editorMatchesReady();
+  if (!E.matchValid || E.matchCount == 0)
+  {
+    editorSetStatusMessage(E.matchValid ? "No matches" : "Search with Ctrl-F first");
+    return;
+  }
+  int k = editorMatchAt(E.cy, E.cx + (dir > 0 ? 1 : 0));
+  if (dir < 0)
+    k = (k + E.matchCount - 1) % E.matchCount;
+  else if (k == E.matchCount)
+    k = 0;
+  editorShowMatch(k);
+}
+
+void editorFind() 
+{
+  int saved_cx = E.cx;
+  int saved_cy = E.cy;
+  int saved_coloff = E.coloff;
+  int saved_rowoff = E.rowoff;
+
+  char *query = editorPrompt(findPrompt, editorFindCallback);
+  if (query) 
+  {
+    free(query);
+  } 
+  else 
+  {
+    E.cx = saved_cx;
+    E.cy = saved_cy;
+    E.coloff = saved_coloff;
+    E.rowoff = saved_rowoff;
+  }
+}
+/*** regex ***/
+
+/*
+ Regular expressions for Ctrl-F, toggled with Ctrl-R in the prompt. The
+ pattern is compiled into a Thompson NFA and rows are matched without
+ backtracking, so the time is linear in the row length for any pattern:
+ - a DFA built lazily from sets of NFA states says whether the row matches,
+ - only rows that do are run through a Pike VM, which simulates the NFA to
+   find where the leftmost match starts and ends,
+ - when every match starts with the same literal, the find kernel skips to
+   the places where it occurs first, otherwise both skip the bytes no match
+   can start with while nothing is under way.
+ All the matches of a row are found by searching again from the end of each
+ one, which keeps that linear in the row too.
+
+ Syntax: . [] [^] a-z \d \w \s \D \W \S \x * + ? {m,n} | () ^ $
+*/
+#define RE_MAX_INSTS 10000
+#define RE_MAX_REPEAT 255
+#define RE_DFA_MAX_STATES 2048                  //The DFA cache starts over when it gets this big
+
+enum reOp
+{
+  RE_SET = 0,                                   //Consume a byte in sets[x]
+  RE_SPLIT,                                     //Continue at x, then (lower priority) at y
+  RE_JMP,
+  RE_BOL,
+  RE_EOL,
+  RE_MATCH
+};
+
+struct reInst
+{
+  unsigned char op;
+  int x;
+  int y;
+};
+
+struct regex
+{
+  struct reInst *prog;
+  int n;
+  int cap;
+  unsigned char (*sets)[32];
+  int nsets;
+  int anchored;                                 //Starts with ^
+  struct finder prefix;                         //Literal every match starts with, len 0 if none
+};
+
+enum reNodeType
+{
+  RN_EMPTY = 0,
+  RN_SET,
+  RN_CAT,
+  RN_ALT,
+  RN_REPEAT,
+  RN_BOL,
+  RN_EOL
+};
+
+struct reNode
+{
+  unsigned char type;
+  int set;
+  int min;
+  int max;                                      //-1 for no limit
+  int a;
+  int b;
+};
+
+struct reParser
+{
+  const char *p;
+  struct regex *re;
+  struct reNode *nodes;
+  int n;
+  int cap;
+  int error;
+};
+
+int reNode(struct reParser *ps, int type, int a, int b)
+{
+  if (ps->n == ps->cap)
+  {
+    ps->cap = ps->cap ? ps->cap * 2 : 64;
+    ps->nodes = realloc(ps->nodes, sizeof(struct reNode) * ps->cap);
+    if (ps->nodes == NULL)
+      die("realloc");
+  }
+  struct reNode *node = &ps->nodes[ps->n];
+  memset(node, 0, sizeof(struct reNode));
+  node->type = type;
+  node->a = a;
+  node->b = b;
+  return ps->n++;
+}
+
+int reNewSet(struct regex *re)
+{
+  re->sets = realloc(re->sets, 32 * (re->nsets + 1));
+  if (re->sets == NULL)
+    die("realloc");
+  memset(re->sets[re->nsets], 0, 32);
+  return re->nsets++;
+}
+
+void reSetAdd(unsigned char *set, int c)
+{
+  set[c >> 3] |= 1 << (c & 7);
+}
+
+int reSetHas(const unsigned char *set, int c)
+{
+  return set[c >> 3] & (1 << (c & 7));
+}
+
+//\d \w \s and friends, 0 if c isn't a class letter
+int reClassEscape(unsigned char *set, int c)
+{
+  int lower = tolower(c);
+  if (lower != 'd' && lower != 'w' && lower != 's')
+    return 0;
+  for (int b = 0; b < 256; b++)
+  {
+    int in = lower == 'd' ? isdigit(b) : lower == 's' ? isspace(b) : (isalnum(b) || b == '_');
+    if ((in != 0) != (c != lower))
+      reSetAdd(set, b);
+  }
+  return 1;
+}
+
+int reEscape(int c)
+{
+  switch (c)
+  {
+    case 't': return '\t';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    default: return c;
+  }
+}
+
+int reParseAlt(struct reParser *ps);
+
+int reParseClass(struct reParser *ps)
+{
+  int set = reNewSet(ps->re);
+  unsigned char tmp[32] = {0};
+  int negate = 0;
+  if (*ps->p == '^')
+  {
+    negate = 1;
+    ps->p++;
+  }
+  int first = 1;
+  while (*ps->p && (*ps->p != ']' || first))
+  {
+    int c = (unsigned char)*ps->p++;
+    first = 0;
+    if (c == '\\' && *ps->p)
+    {
+      c = (unsigned char)*ps->p++;
+      if (reClassEscape(tmp, c))
+        continue;
+      c = reEscape(c);
+    }
+    int hi = c;
+    if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']')
+    {
+      hi = (unsigned char)ps->p[1];
+      ps->p += 2;
+      if (hi == '\\' && *ps->p)
+        hi = reEscape((unsigned char)*ps->p++);
+    }
+    for (int b = c; b <= hi; b++)
+      reSetAdd(tmp, b);
+  }
+  if (*ps->p != ']')
+  {
+    ps->error = 1;
+    return reNode(ps, RN_EMPTY, -1, -1);
+  }
+  ps->p++;
+  for (int i = 0; i < 32; i++)
+    ps->re->sets[set][i] = negate ? ~tmp[i] : tmp[i];
+  int node = reNode(ps, RN_SET, -1, -1);
+  ps->nodes[node].set = set;
+  return node;
+}
+
+int reParseAtom(struct reParser *ps)
+{
+  int c = (unsigned char)*ps->p++;
+  int node, set;
+  switch (c)
+  {
+    case '(':
+      node = reParseAlt(ps);
+      if (*ps->p != ')')
+        ps->error = 1;
+      else
+        ps->p++;
+      return node;
+    case '[':
+      return reParseClass(ps);
+    case '^':
+      return reNode(ps, RN_BOL, -1, -1);
+    case '$':
+      return reNode(ps, RN_EOL, -1, -1);
+    case '*': case '+': case '?': case '{': case ')': case '|':
+      ps->error = 1;
+      return reNode(ps, RN_EMPTY, -1, -1);
+  }
+  set = reNewSet(ps->re);
+  if (c == '.')
+    memset(ps->re->sets[set], 0xff, 32);
+  else if (c == '\\' && *ps->p)
+  {
+    c = (unsigned char)*ps->p++;
+    if (!reClassEscape(ps->re->sets[set], c))
+      reSetAdd(ps->re->sets[set], reEscape(c));
+  }
+  else
+    reSetAdd(ps->re->sets[set], c);
+  node = reNode(ps, RN_SET, -1, -1);
+  ps->nodes[node].set = set;
+  return node;
+}
+
+int reParseNumber(struct reParser *ps)
+{
+  int n = 0;
+  if (!isdigit((unsigned char)*ps->p))
+    return -1;
+  while (isdigit((unsigned char)*ps->p) && n <= RE_MAX_REPEAT)
+    n = n * 10 + *ps->p++ - '0';
+  return n;
+}
+
+int reParseRepeat(struct reParser *ps)
+{
+  int node = reParseAtom(ps);
+  while (*ps->p == '*' || *ps->p == '+' || *ps->p == '?' || *ps->p == '{')
+  {
+    int min = 0, max = -1;
+    char c = *ps->p++;
+    if (c == '+')
+      min = 1;
+    else if (c == '?')
+      max = 1;
+    else if (c == '{')
+    {
+      min = reParseNumber(ps);
+      max = min;
+      if (*ps->p == ',')
+      {
+        ps->p++;
+        max = *ps->p == '}' ? -1 : reParseNumber(ps);
+      }
+      if (*ps->p != '}' || min < 0 || min > RE_MAX_REPEAT || max > RE_MAX_REPEAT ||
+          (max != -1 && max < min))
+      {
+        ps->error = 1;
+        return node;
+      }
+      ps->p++;
+    }
+    int rep = reNode(ps, RN_REPEAT, node, -1);
+    ps->nodes[rep].min = min;
+    ps->nodes[rep].max = max;
+    node = rep;
+  }
+  return node;
+}
+
+int reParseCat(struct reParser *ps)
+{
+  int node = -1;
+  while (*ps->p && *ps->p != '|' && *ps->p != ')' && !ps->error)
+  {
+    int next = reParseRepeat(ps);
+    node = node == -1 ? next : reNode(ps, RN_CAT, node, next);
+  }
+  return node == -1 ? reNode(ps, RN_EMPTY, -1, -1) : node;
+}
+
+int reParseAlt(struct reParser *ps)
+{
+  int node = reParseCat(ps);
+  while (*ps->p == '|' && !ps->error)
+  {
+    ps->p++;
+    node = reNode(ps, RN_ALT, node, reParseCat(ps));
+  }
+  return node;
+}
+
+int reEmit(struct regex *re, int op, int x, int y)
+{
+  if (re->n == re->cap)
+  {
+    re->cap = re->cap ? re->cap * 2 : 64;
+    re->prog = realloc(re->prog, sizeof(struct reInst) * re->cap);
+    if (re->prog == NULL)
+      die("realloc");
+  }
+  re->prog[re->n].op = op;
+  re->prog[re->n].x = x;
+  re->prog[re->n].y = y;
+  return re->n++;
+}
+
+//Append the code for a node, 0 if the program got too big
+int reCompileNode(struct regex *re, struct reNode *nodes, int i)
+{
+  struct reNode *node = &nodes[i];
+  int l1, l2, j;
+  if (re->n > RE_MAX_INSTS)
+    return 0;
+  switch (node->type)
+  {
+    case RN_SET:
+      reEmit(re, RE_SET, node->set, 0);
+      break;
+    case RN_BOL:
+      reEmit(re, RE_BOL, 0, 0);
+      break;
+    case RN_EOL:
+      reEmit(re, RE_EOL, 0, 0);
+      break;
+    case RN_CAT:
+      return reCompileNode(re, nodes, node->a) && reCompileNode(re, nodes, node->b);
+    case RN_ALT:
+      l1 = reEmit(re, RE_SPLIT, re->n + 1, 0);
+      if (!reCompileNode(re, nodes, node->a))
+        return 0;
+      l2 = reEmit(re, RE_JMP, 0, 0);
+      re->prog[l1].y = re->n;
+      if (!reCompileNode(re, nodes, node->b))
+        return 0;
+      re->prog[l2].x = re->n;
+      break;
+    case RN_REPEAT:
+      for (j = 0; j < node->min; j++)
+        if (!reCompileNode(re, nodes, node->a))
+          return 0;
+      if (node->max == -1)
+      {
+        l1 = reEmit(re, RE_SPLIT, re->n + 1, 0);
+        if (!reCompileNode(re, nodes, node->a))
+          return 0;
+        reEmit(re, RE_JMP, l1, 0);
+        re->prog[l1].y = re->n;
+      }
+      else
+      {
+        //Optional copies: each SPLIT skips to the end, patched once it is known
+        int first = re->n;
+        for (j = node->min; j < node->max; j++)
+        {
+          reEmit(re, RE_SPLIT, re->n + 1, -1);
+          if (!reCompileNode(re, nodes, node->a))
+            return 0;
+        }
+        for (j = first; j < re->n; j++)
+          if (re->prog[j].op == RE_SPLIT && re->prog[j].y == -1)
+            re->prog[j].y = re->n;
+      }
+      break;
+  }
+  return re->n <= RE_MAX_INSTS;
+}
+
+//Collect the literal bytes every match starts with, 0 once the prefix ends
+int reCollectPrefix(struct regex *re, struct reNode *nodes, int i, char *buf, int *n)
+{
+  struct reNode *node = &nodes[i];
+  int c, count = 0, last = 0;
+  switch (node->type)
+  {
+    case RN_CAT:
+      return reCollectPrefix(re, nodes, node->a, buf, n) && reCollectPrefix(re, nodes, node->b, buf, n);
+    case RN_BOL:
+      if (*n > 0 || re->anchored)
+        return 0;
+      re->anchored = 1;
+      return 1;
+    case RN_SET:
+      for (c = 0; c < 256 && count < 2; c++)
+        if (reSetHas(re->sets[node->set], c))
+        {
+          count++;
+          last = c;
+        }
+      if (count != 1 || *n >= 64)
+        return 0;
+      buf[(*n)++] = last;
+      return 1;
+    case RN_REPEAT:
+      //x{2,} starts with xx, and only x{2} can be followed by more of the prefix
+      for (c = 0; c < node->min; c++)
+        if (!reCollectPrefix(re, nodes, node->a, buf, n))
+          return 0;
+      return node->min == node->max;
+    default:
+      return 0;
+  }
+}
+
+void reFree(struct regex *re)
+{
+  if (re == NULL)
+    return;
+  free(re->prog);
+  free(re->sets);
+  free(re->prefix.q);
+  free(re);
+}
+
+//NULL if the pattern is not valid
+struct regex *reCompile(const char *pattern)
+{
+  struct regex *re = calloc(1, sizeof(struct regex));
+  if (re == NULL)
+    die("calloc");
+  struct reParser ps = { pattern, re, NULL, 0, 0, 0 };
+  int root = reParseAlt(&ps);
+  if (*ps.p)
+    ps.error = 1;
+  if (!ps.error && reCompileNode(re, ps.nodes, root))
+  {
+    char buf[64];
+    int n = 0;
+    reEmit(re, RE_MATCH, 0, 0);
+    reCollectPrefix(re, ps.nodes, root, buf, &n);
+    buf[n] = '\0';
+    finderInit(&re->prefix, buf, n);
+  }
+  else
+  {
+    reFree(re);
+    re = NULL;
+  }
+  free(ps.nodes);
+  return re;
+}
+
+/*
+ Per-thread matching state: the DFA built so far and the Pike VM's thread
+ lists. A DFA state is the sorted set of NFA instructions that consume a
+ byte, match, or wait for the end of the line.
+*/
+struct reDState
+{
+  int pcs;                                      //Offset of the set in pool
+  int npcs;
+  int stop;                                     //A match ends here or none can any more
+  int match;                                    //A match ends here
+  int matchAtEol;                               //... if the line ends here
+  struct reDState *next[256];                   //NULL until computed
+};
+
+struct reThread
+{
+  int pc;
+  int start;
+};
+
+struct reCache
+{
+  struct regex *re;
+  struct reDState *states;
+  int nstates;
+  int *table;                                   //Hash of pc sets to state + 1
+  int tableSize;
+  int *pool;
+  int poolLen;
+  int poolCap;
+  int start[2];                                 //Start states at and after the line start, -1 until built
+  int resets;
+  unsigned long built;                          //States built and bytes scanned, to tell when the DFA doesn't pay
+  unsigned long scanned;
+  unsigned char first[256];                     //Bytes a match after the line start can start with
+  int firstByte;                                //The only one of them, -1 if more
+  int firstSkip;                                //Bytes not in first can be skipped: every match needs one
+  unsigned int *mark;                           //Per instruction, the generation it was last added in
+  unsigned int gen;
+  int *stack;
+  int *set;
+  struct reThread *clist;
+  struct reThread *nlist;
+};
+
+struct reCache *reCacheNew(struct regex *re)
+{
+  struct reCache *c = calloc(1, sizeof(struct reCache));
+  if (c == NULL)
+    die("calloc");
+  c->re = re;
+  c->tableSize = RE_DFA_MAX_STATES * 2;
+  c->states = malloc(sizeof(struct reDState) * RE_DFA_MAX_STATES);
+  c->table = calloc(c->tableSize, sizeof(int));
+  c->mark = calloc(re->n, sizeof(unsigned int));
+  c->stack = malloc(sizeof(int) * (re->n * 2 + 2));
+  c->set = malloc(sizeof(int) * re->n);
+  c->clist = malloc(sizeof(struct reThread) * re->n);
+  c->nlist = malloc(sizeof(struct reThread) * re->n);
+  if (c->states == NULL || c->table == NULL || c->mark == NULL || c->stack == NULL ||
+      c->set == NULL || c->clist == NULL || c->nlist == NULL)
+    die("malloc");
+  c->start[0] = c->start[1] = -1;
+  return c;
+}
+
+void reCacheFree(struct reCache *c)
+{
+  if (c == NULL)
+    return;
+  free(c->states);
+  free(c->table);
+  free(c->pool);
+  free(c->mark);
+  free(c->stack);
+  free(c->set);
+  free(c->clist);
+  free(c->nlist);
+  free(c);
+}
+
+void reCacheReset(struct reCache *c)
+{
+  c->resets++;
+  c->nstates = 0;
+  c->poolLen = 0;
+  memset(c->table, 0, sizeof(int) * c->tableSize);
+  c->start[0] = c->start[1] = -1;
+}
+
+//Add pc and what it reaches without consuming a byte to c->set, at the line start/end if bol/eol
+void reClosure(struct reCache *c, int pc, int bol, int eol, int *n)
+{
+  struct reInst *prog = c->re->prog;
+  int sp = 0;
+  c->stack[sp++] = pc;
+  while (sp > 0)
+  {
+    pc = c->stack[--sp];
+    if (c->mark[pc] == c->gen)
+      continue;
+    c->mark[pc] = c->gen;
+    switch (prog[pc].op)
+    {
+      case RE_JMP:
+        c->stack[sp++] = prog[pc].x;
+        break;
+      case RE_SPLIT:
+        c->stack[sp++] = prog[pc].y;
+        c->stack[sp++] = prog[pc].x;
+        break;
+      case RE_BOL:
+        if (bol)
+          c->stack[sp++] = pc + 1;
+        break;
+      case RE_EOL:
+        if (eol)
+          c->stack[sp++] = pc + 1;
+        else
+          c->set[(*n)++] = pc;
+        break;
+      default:
+        c->set[(*n)++] = pc;
+        break;
+    }
+  }
+}
+
+int reIntCmp(const void *a, const void *b)
+{
+  return *(const int *)a - *(const int *)b;
+}
+
+//The state for the n instructions in c->set, added if new; -1 if the cache is full
+int reDState(struct reCache *c, int n)
+{
+  struct reInst *prog = c->re->prog;
+  unsigned int h = 2166136261u;
+  int i;
+  qsort(c->set, n, sizeof(int), reIntCmp);
+  for (i = 0; i < n; i++)
+    h = (h ^ c->set[i]) * 16777619u;
+  unsigned int slot = h & (c->tableSize - 1);
+  while (c->table[slot])
+  {
+    struct reDState *d = &c->states[c->table[slot] - 1];
+    if (d->npcs == n && !memcmp(&c->pool[d->pcs], c->set, sizeof(int) * n))
+      return c->table[slot] - 1;
+    slot = (slot + 1) & (c->tableSize - 1);
+  }
+  if (c->nstates == RE_DFA_MAX_STATES)
+    return -1;
+  if (c->poolLen + n > c->poolCap)
+  {
+    c->poolCap = (c->poolLen + n) * 2;
+    c->pool = realloc(c->pool, sizeof(int) * c->poolCap);
+    if (c->pool == NULL)
+      die("realloc");
+  }
+  struct reDState *d = &c->states[c->nstates];
+  d->pcs = c->poolLen;
+  d->npcs = n;
+  if (n)
+    memcpy(&c->pool[d->pcs], c->set, sizeof(int) * n);
+  c->poolLen += n;
+  d->match = 0;
+  d->matchAtEol = 0;
+  memset(d->next, 0, sizeof(d->next));
+  //Whether a match ends here, or would if the line ended here
+  int eol = 0;
+  c->gen++;
+  for (i = 0; i < n; i++)
+  {
+    int pc = c->pool[d->pcs + i];
+    if (prog[pc].op == RE_MATCH)
+      d->match = 1;
+    else if (prog[pc].op == RE_EOL)
+      reClosure(c, pc + 1, 0, 1, &eol);
+  }
+  for (i = 0; i < eol; i++)
+    if (prog[c->set[i]].op == RE_MATCH)
+      d->matchAtEol = 1;
+  d->stop = d->match || n == 0;
+  c->table[slot] = ++c->nstates;
+  c->built++;
+  return c->nstates - 1;
+}
+
+int reStartState(struct reCache *c, int bol)
+{
+  if (c->start[bol] == -1)
+  {
+    int n = 0;
+    c->gen++;
+    reClosure(c, 0, bol, 0, &n);
+    c->start[bol] = reDState(c, n);
+    if (c->start[bol] == -1)
+    {
+      reCacheReset(c);
+      return reStartState(c, bol);
+    }
+    if (!bol)
+    {
+      struct reDState *d = &c->states[c->start[0]];
+      int count = 0;
+      memset(c->first, 0, sizeof(c->first));
+      c->firstSkip = 1;
+      for (int i = 0; i < d->npcs; i++)
+      {
+        struct reInst *inst = &c->re->prog[c->pool[d->pcs + i]];
+        if (inst->op != RE_SET)
+          c->firstSkip = 0;
+        else
+          for (int b = 0; b < 256; b++)
+            c->first[b] |= reSetHas(c->re->sets[inst->x], b) != 0;
+      }
+      for (int b = 0; b < 256; b++)
+        if (c->first[b])
+        {
+          count++;
+          c->firstByte = b;
+        }
+      if (count != 1 || !c->firstSkip)
+        c->firstByte = -1;
+    }
+  }
+  return c->start[bol];
+}
+
+//Follow byte b from state d, building the next state if needed
+struct reDState *reDStep(struct reCache *c, struct reDState *d, unsigned char b)
+{
+  struct reInst *prog = c->re->prog;
+  int n = 0;
+  c->gen++;
+  for (int i = 0; i < d->npcs; i++)
+  {
+    int pc = c->pool[d->pcs + i];
+    if (prog[pc].op == RE_SET && reSetHas(c->re->sets[prog[pc].x], b))
+      reClosure(c, pc + 1, 0, 0, &n);
+  }
+  //A match can also start at the next byte
+  reClosure(c, 0, 0, 0, &n);
+  int next = reDState(c, n);
+  if (next == -1)
+  {
+    //Start over, keeping only the state being built
+    reCacheReset(c);
+    return &c->states[reDState(c, n)];
+  }
+  d->next[b] = &c->states[next];
+  return d->next[b];
+}
+
+/*
+ Does a match start at or after from? Linear in len - from. A full cache
+ starts over and the scan goes on from the state it was in. When the DFA
+ keeps outgrowing its cache, building states costs more than running the
+ NFA, so this answers "maybe" and leaves it to the Pike VM.
+*/
+int reDfaScan(struct reCache *c, const char *s, int len, int from)
+{
+  if (c->built > RE_DFA_MAX_STATES && c->scanned / c->built < 16)
+    return 1;
+  c->scanned += len - from;
+  int resets = c->resets;
+  struct reDState *skip = &c->states[reStartState(c, 0)];
+  struct reDState *d = &c->states[reStartState(c, from == 0)];
+  int first = c->firstByte;
+  if (!c->firstSkip || c->start[0] < 0)
+    skip = NULL;
+  for (int i = from; i < len; i++)
+  {
+    if (d->stop)
+      return d->match;
+    //Nothing is under way: jump to where the next match could start
+    if (d == skip)
+    {
+      if (first >= 0)
+      {
+        const char *p = memchr(s + i, first, len - i);
+        i = p ? p - s : len;
+      }
+      else
+        while (i < len && !c->first[(unsigned char)s[i]])
+          i++;
+      if (i == len)
+        break;
+    }
+    struct reDState *next = d->next[(unsigned char)s[i]];
+    if (next == NULL)
+    {
+      next = reDStep(c, d, s[i]);
+      if (c->resets != resets)
+      {
+        resets = c->resets;
+        skip = skip ? &c->states[reStartState(c, 0)] : NULL;
+      }
+    }
+    d = next;
+  }
+  return d->match || d->matchAtEol;
+}
+
+void rePikeAdd(struct reCache *c, struct reThread *list, int *n, int pc, int start, int pos, int len)
+{
+  struct reInst *prog = c->re->prog;
+  if (c->mark[pc] == c->gen)
+    return;
+  c->mark[pc] = c->gen;
+  switch (prog[pc].op)
+  {
+    case RE_JMP:
+      rePikeAdd(c, list, n, prog[pc].x, start, pos, len);
+      break;
+    case RE_SPLIT:
+      rePikeAdd(c, list, n, prog[pc].x, start, pos, len);
+      rePikeAdd(c, list, n, prog[pc].y, start, pos, len);
+      break;
+    case RE_BOL:
+      if (pos == 0)
+        rePikeAdd(c, list, n, pc + 1, start, pos, len);
+      break;
+    case RE_EOL:
+      if (pos == len)
+        rePikeAdd(c, list, n, pc + 1, start, pos, len);
+      break;
+    default:
+      list[*n].pc = pc;
+      list[(*n)++].start = start;
+      break;
+  }
+}
+
+/*
+ Leftmost match at or after from, preferring the alternatives that come first
+ like Perl does. While no thread is alive the bytes no match starts with are
+ skipped instead of being stepped through.
+*/
+int rePike(struct reCache *c, const char *s, int len, int from, int *mlen)
+{
+  struct reInst *prog = c->re->prog;
+  int nc = 0, nn, i, k;
+  int mstart = -1, mend = -1;
+  c->gen++;
+  for (i = from; ; i++)
+  {
+    if (mstart == -1 && nc == 0 && i > 0 && c->firstSkip)
+    {
+      while (i < len && !c->first[(unsigned char)s[i]])
+        i++;
+      if (i == len)
+        break;
+    }
+    if (mstart == -1)
+      rePikeAdd(c, c->clist, &nc, 0, i, i, len);
+    if (nc == 0)
+      break;
+    nn = 0;
+    c->gen++;
+    for (k = 0; k < nc; k++)
+    {
+      struct reThread *t = &c->clist[k];
+      if (prog[t->pc].op == RE_MATCH)
+      {
+        mstart = t->start;
+        mend = i;
+        break;                                  //Threads after this one have lower priority
+      }
+      if (i < len && reSetHas(c->re->sets[prog[t->pc].x], (unsigned char)s[i]))
+        rePikeAdd(c, c->nlist, &nn, t->pc + 1, t->start, i + 1, len);
+    }
+    struct reThread *tmp = c->clist;
+    c->clist = c->nlist;
+    c->nlist = tmp;
+    nc = nn;
+    if (i >= len)
+      break;
+  }
+  if (mstart >= 0)
+    *mlen = mend - mstart;
+  return mstart;
+}
+
+//Start of the leftmost match in s[from, len), -1 if none
+int reSearch(struct regex *re, struct reCache *c, const char *s, int len, int from, int *mlen)
+{
+  if (from > len || (re->anchored && from > 0))
+    return -1;
+  if (re->prefix.len)
+  {
+    const char *p = findKernel(&re->prefix, s + from, len - from);
+    if (p == NULL)
+      return -1;
+    from = p - s;
+    if (re->anchored && from > 0)
+      return -1;
+  }
+  if (!reDfaScan(c, s, len, from))
+    return -1;
+  return rePike(c, s, len, from, mlen);
+}
+
+struct finder *rePrefix(struct regex *re)
+{
+  return re->prefix.len ? &re->prefix : NULL;
+}
+
+/*** themes ***/
+
+/*
+ A theme gives every highlight class a color and attributes. The file has
+ one class per line, for example
+
+   keyword1 = #ffaf00 bold
+   comment  = 244 italic
+   string   = green
+
+ where colors are default, one of the eight names (bright-red and so on for
+ the other eight), a 256-color index or #rrggbb. Whatever the terminal cannot
+ show is brought down to the nearest color it can when the theme is loaded,
+ and that is also when the escape for every class is put together: drawing
+ only copies them.
+*/
+
+const char *themeClassNames[HL_CLASSES] = {
+  "normal", "comment", "mlcomment", "keyword1", "keyword2", "string", "number", "match"
+};
+
+const char *themeColorNames[8] = {
+  "black", "red", "green", "yellow", "blue", "magenta", "cyan", "white"
+};
+
+//Decide once how many colors the terminal takes
+void editorDetectColors()
+{
+  const char *colorterm = getenv("COLORTERM");
+  const char *term = getenv("TERM");
+  E.termColors = 8;
+  if (colorterm && (!strcmp(colorterm, "truecolor") || !strcmp(colorterm, "24bit")))
+    E.termColors = 1 << 24;
+  else if (term && strstr(term, "256color"))
+    E.termColors = 256;
+}
+
+//Whether p starts a #rrggbb color: six hex digits, then a blank or the end of the line
+int themeIsRGB(const char *p)
+{
+  int i;
+  for (i = 1; i <= 6; i++)
+    if (!isxdigit((unsigned char)p[i]))
+      return 0;
+  return p[7] == '\0' || isspace((unsigned char)p[7]);
+}
+
+//Parse a color, returns 0 if it isn't one
+int themeParseColor(const char *s, int *color)
+{
+  int i;
+  if (!strcmp(s, "default"))
+  {
+    *color = THEME_DEFAULT;
+    return 1;
+  }
+  int bright = !strncmp(s, "bright-", 7);
+  for (i = 0; i < 8; i++)
+    if (!strcmp(bright ? s + 7 : s, themeColorNames[i]))
+    {
+      *color = i + (bright ? 8 : 0);
+      return 1;
+    }
+  char *end;
+  if (s[0] == '#' && themeIsRGB(s))
+  {
+    *color = THEME_RGB | (int)strtol(s + 1, NULL, 16);
+    return 1;
+  }
+  long n = strtol(s, &end, 10);
+  if (*s == '\0' || *end != '\0' || n < 0 || n > 255)
+    return 0;
+  *color = n;
+  return 1;
+}
+
+//Red, green and blue of a 256-color palette entry, as xterm has them
+int themePaletteRGB(int n)
+{
+  static const int basic[16] = {
+    0x000000, 0xcd0000, 0x00cd00, 0xcdcd00, 0x0000ee, 0xcd00cd, 0x00cdcd, 0xe5e5e5,
+    0x7f7f7f, 0xff0000, 0x00ff00, 0xffff00, 0x5c5cff, 0xff00ff, 0x00ffff, 0xffffff
+  };
+  static const int level[6] = {0, 95, 135, 175, 215, 255};
+  if (n < 16)
+    return basic[n];
+  if (n >= 232)
+  {
+    int v = 8 + 10 * (n - 232);
+    return v << 16 | v << 8 | v;
+  }
+  n -= 16;
+  return level[n / 36] << 16 | level[n / 6 % 6] << 8 | level[n % 6];
+}
+
+//Nearest entry of the 6x6x6 color cube or the gray ramp
+int themeTo256(int rgb)
+{
+  int r = rgb >> 16 & 0xff, g = rgb >> 8 & 0xff, b = rgb & 0xff;
+  if (r == g && g == b)
+  {
+    if (r < 8)
+      return 16;
+    if (r > 238)
+      return 231;
+    return 232 + (r - 8) / 10;
+  }
+  int cr = r < 48 ? 0 : r < 115 ? 1 : (r - 35) / 40;
+  int cg = g < 48 ? 0 : g < 115 ? 1 : (g - 35) / 40;
+  int cb = b < 48 ? 0 : b < 115 ? 1 : (b - 35) / 40;
+  return 16 + 36 * cr + 6 * cg + cb;
+}
+
+//Nearest of the eight basic colors, bright if it is light
+int themeTo16(int rgb)
+{
+  int r = rgb >> 16 & 0xff, g = rgb >> 8 & 0xff, b = rgb & 0xff;
+  int n = (r > 127) | (g > 127) << 1 | (b > 127) << 2;
+  return n + ((r + g + b) / 3 > 191 ? 8 : 0);
+}
+
+//Build the escape of every class for the current theme and terminal
+void editorThemeCompile()
+{
+  int attrs = 0, h;
+  for (h = 0; h < HL_CLASSES; h++)
+    attrs |= E.theme[h].bold || E.theme[h].italic;
+  for (h = 0; h < HL_CLASSES; h++)
   {
-    current += direction;
-    if (current == -1)
-       current = E.numRows - 1;
-    else if (current == E.numRows) 
-       current = 0;
- 
-   erow *row = &E.row[current];
-    
-    char *match = strstr(row->render, query);
-    if (match) 
-    {
-      last_match = current;
-      E.cy = current;
-      
-      E.cx = editorRowRxToCx(row, match - row->render);
-      E.rowoff = E.numRows;
-
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
+    struct themeStyle *t = &E.theme[h];
+    char *p = E.themeSgr[h];
+    int n = THEME_SGR_MAX, len = 0;
+    len += snprintf(p + len, n - len, "\x1b[");
+    if (attrs)                                    //Classes without them have to turn them off
+      len += snprintf(p + len, n - len, "22;23;%s%s", t->bold ? "1;" : "", t->italic ? "3;" : "");
+    int c = t->color;
+    if (c != THEME_DEFAULT && (c & THEME_RGB))
+    {
+      if (E.termColors > 256)
+      {
+        len += snprintf(p + len, n - len, "38;2;%d;%d;%dm", c >> 16 & 0xff, c >> 8 & 0xff, c & 0xff);
+        E.themeSgrLen[h] = len;
+        continue;
+      }
+      c = E.termColors == 256 ? themeTo256(c & 0xffffff) : themeTo16(c & 0xffffff);
     }
+    if (c >= 16 && E.termColors < 256)
+      c = themeTo16(themePaletteRGB(c));
+    if (c == THEME_DEFAULT)
+      len += snprintf(p + len, n - len, "39m");
+    else if (c < 8)
+      len += snprintf(p + len, n - len, "%dm", 30 + c);
+    else if (c < 16)
+      len += snprintf(p + len, n - len, "%dm", 90 + c - 8);
+    else
+      len += snprintf(p + len, n - len, "38;5;%dm", c);
+    E.themeSgrLen[h] = len;
   }
+  E.termHl = -1;                                  //Whatever the terminal has may not be a class any more
 }
 
-void editorFind() 
+//The built in theme, the eight basic colors
+void editorThemeDefault()
 {
-  int saved_cx = E.cx;
-  int saved_cy = E.cy;
-  int saved_coloff = E.coloff;
-  int saved_rowoff = E.rowoff;
+  int h;
+  for (h = 0; h < HL_CLASSES; h++)
+  {
+    E.theme[h].color = h == HL_NORMAL ? THEME_DEFAULT : editorSyntaxToColor(h) - 30;
+    E.theme[h].bold = 0;
+    E.theme[h].italic = 0;
+  }
+}
 
-  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
-  if (query) 
+//Load the theme file over the built in theme, a bad line is reported and skipped
+void editorLoadTheme()
+{
+  char path[PATH_MAX];
+  const char *name = getenv("EDITOR_THEME");
+  const char *home = getenv("HOME");
+  editorThemeDefault();
+  if (name == NULL && home != NULL)
   {
-    free(query);
-  } 
-  else 
+    snprintf(path, sizeof(path), "%s/%s", home, THEME_FILE);
+    name = path;
+  }
+  FILE *fp = name ? fopen(name, "r") : NULL;
+  if (fp != NULL)
   {
-    E.cx = saved_cx;
-    E.cy = saved_cy;
-    E.coloff = saved_coloff;
-    E.rowoff = saved_rowoff;
+    char line[256];
+    int lineno = 0, bad = 0;
+    while (fgets(line, sizeof(line), fp))
+    {
+      lineno++;
+      char *hash = line;
+      while ((hash = strchr(hash, '#')) != NULL && themeIsRGB(hash))
+        hash++;                                   //A #rrggbb color, not a comment
+      if (hash)
+        *hash = '\0';
+      char *tok = strtok(line, " \t=\r\n");
+      if (tok == NULL)
+        continue;
+      int h;
+      for (h = 0; h < HL_CLASSES; h++)
+        if (!strcmp(tok, themeClassNames[h]))
+          break;
+      struct themeStyle t = {THEME_DEFAULT, 0, 0};
+      int ok = h < HL_CLASSES;
+      while (ok && (tok = strtok(NULL, " \t=\r\n")) != NULL)
+      {
+        if (!strcmp(tok, "bold"))
+          t.bold = 1;
+        else if (!strcmp(tok, "italic"))
+          t.italic = 1;
+        else
+          ok = themeParseColor(tok, &t.color);
+      }
+      if (ok)
+        E.theme[h] = t;
+      else if (!bad++)
+        editorSetStatusMessage("%s:%d: bad theme line", name, lineno);
+    }
+    fclose(fp);
   }
+  editorThemeCompile();
 }
+
 /*** append buffer ***/
 
+/*
+ The buffer grows geometrically and is kept from one frame to the next
+ (abReset), so after the first few frames building one does not allocate.
+*/
 struct abuf {
   char *b;
   int len;
+  int cap;
 };
 
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
+
+struct abuf screenBuf = ABUF_INIT;              //Output of editorRefreshScreen, reused every frame
+
+//Make room for len more bytes, returns where they go or NULL
+char *abReserve(struct abuf *ab, int len)
+{
+  if (ab->len + len > ab->cap)
+  {
+    int cap = ab->cap ? ab->cap * 2 : 4096;
+    while (cap < ab->len + len)
+      cap *= 2;
+    char *new = realloc(ab->b, cap);
+    if (new == NULL)
+      return NULL;
+    ab->b = new;
+    ab->cap = cap;
+  }
+  return &ab->b[ab->len];
+}
 
 void abAppend(struct abuf *ab, const char *s, int len) 
 {
-  char *new = realloc(ab->b, ab->len + len);
-  if (new == NULL) 
+  char *p = abReserve(ab, len);
+  if (p == NULL) 
    {
     return;
    }
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
+  memcpy(p, s, len);
   ab->len += len;
 }
 
+void abReset(struct abuf *ab)
+{
+  ab->len = 0;
+}
+
 void abFree(struct abuf *ab) 
 {
   free(ab->b);
+  ab->b = NULL;
+  ab->len = ab->cap = 0;
 }
 
 /***OUTPUT***/
@@ -861,7 +6156,7 @@ void editorScroll()
   E.rx = 0;
   if (E.cy < E.numRows)
   {
-    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
   }
   if (E.cy < E.rowoff) 
   {
@@ -881,7 +6176,120 @@ void editorScroll()
    }
 }
 
-void editorDrawRows(struct abuf *ab)
+/*
+ Every frame is first drawn into a grid of cells (E.frame). It is then
+ compared with the grid that was last sent to the terminal (E.shadow) and
+ only the parts of the lines that differ are written, with cursor addressing.
+ When the view scrolled by less than a screen the terminal is asked to
+ scroll the text area first, so the rows that are still visible are reused.
+ Rows are drawn span by span, one span per highlight run, and written the
+ same way: one color change and one copy out of the text plane per span.
+*/
+
+//Fill n cells of a grid from i on with blanks
+void editorGridClear(struct grid *g, int i, int n)
+{
+  memset(&g->ch[i], ' ', n);
+  memset(&g->hl[i], HL_NORMAL, n);
+  memset(&g->attr[i], 0, n);
+}
+
+//Put a string into line y of the frame starting at column x, returns the next column
+int editorFramePut(int y, int x, const char *s, int len, int hl, int attr)
+{
+  if (len > E.screenCols - x)
+    len = E.screenCols - x;
+  if (len <= 0)
+    return x;
+  int i = y * E.screenCols + x;
+  memcpy(&E.frame.ch[i], s, len);
+  memset(&E.frame.hl[i], hl, len);
+  memset(&E.frame.attr[i], attr, len);
+  return x + len;
+}
+
+//Put the grapheme s into cell i of the frame, bytes that aren't UTF-8 and C1 controls show as '?'
+void editorFrameGlyph(int i, const char *s, int len)
+{
+  int cp;
+  char *g = &E.frame.glyph[i * CELL_GLYPH];
+  if (utf8Decode(s, len, &cp) == 0 || (cp >= 0x80 && cp < 0xa0))
+  {
+    E.frame.ch[i] = '?';
+    E.frame.hl[i] = HL_NORMAL;
+    E.frame.attr[i] = CELL_REVERSE;
+    return;
+  }
+  int n = 0;
+  E.frame.ch[i] = RENDER_GLYPH;
+  if (unicodeWidth(cp) == 0)
+    g[++n] = ' ';                                 //Marks with nothing to go on
+  memcpy(&g[n + 1], s, len);
+  g[0] = n + len;
+}
+
+//editorFramePut for text that may not be ASCII
+int editorFramePutText(int y, int x, const char *s, int len, int hl, int attr)
+{
+  const char marks[2] = {RENDER_GLYPH, RENDER_WIDE};
+  while (len > 0 && x < E.screenCols)
+  {
+    int n = wideKernel(s, len), w;
+    x = editorFramePut(y, x, s, n, hl, attr);
+    s += n;
+    len -= n;
+    if (len == 0)
+      break;
+    n = *s == '\t' ? 1 : utf8Grapheme(s, len, &w);
+    if (*s == '\t')
+      x = editorFramePut(y, x, " ", 1, hl, attr);
+    else
+    {
+      w = w ? w : 1;
+      if (x + w > E.screenCols)
+        break;
+      editorFramePut(y, x, marks, w, hl, attr);
+      editorFrameGlyph(y * E.screenCols + x, s, n);
+      x += w;
+    }
+    s += n;
+    len -= n;
+  }
+  return x;
+}
+
+//Fill in the characters of line y that aren't ASCII, len columns of the row are on screen
+void editorDrawGlyphs(erow *row, int y, int len)
+{
+  struct rowExtra *x = row->x;
+  //First wide character that ends after the first column drawn
+  int k = 0, hi = x->nwide;
+  while (k < hi)
+  {
+    int mid = (k + hi) / 2;
+    if (x->wide[mid].rx + x->wide[mid].width <= E.coloff)
+      k = mid + 1;
+    else
+      hi = mid;
+  }
+  for (; k < x->nwide && x->wide[k].rx < E.coloff + len; k++)
+  {
+    struct wideChar *c = &x->wide[k];
+    int col = c->rx - E.coloff;
+    if (row->chars[c->cx] == '\t')
+      continue;
+    if (col < 0 || col + c->width > len)
+    {
+      //Half of it is off screen, the other half is left blank
+      int from = col < 0 ? 0 : col, to = col + c->width < len ? col + c->width : len;
+      memset(&E.frame.ch[y * E.screenCols + from], ' ', to - from);
+      continue;
+    }
+    editorFrameGlyph(y * E.screenCols + col, &row->chars[c->cx], c->len);
+  }
+}
+
+void editorDrawRows()
 {
   int i;
   for(i=0;i<E.screenRows;i++)
@@ -900,137 +6308,333 @@ void editorDrawRows(struct abuf *ab)
        }
       int padding = (E.screenCols - welcomelen) / 2;
       if (padding) 
-      {
-        abAppend(ab, "~", 1);
-        padding--;
-      }
-      while (padding--) 
-        {
-         abAppend(ab, " ", 1);
-        }
-      abAppend(ab, welcome, welcomelen);
+        editorFramePut(i, 0, "~", 1, HL_NORMAL, 0);
+      editorFramePut(i, padding, welcome, welcomelen, HL_NORMAL, 0);
     } 
     else 
     {
-      abAppend(ab, "~", 1);
+      editorFramePut(i, 0, "~", 1, HL_NORMAL, 0);
     }
    } 
    else 
     {
-      int len = E.row[filerow].rsize-E.coloff;
+      erow *row = editorRowAt(filerow);
+      editorRowRender(row);
+      struct rowWindow *w = editorRowWin(row);
+      int rstart = w ? w->rstart : 0;               //Long rows only render a window of columns
+      int hlstart = w ? w->hlstart : 0;
+      int len = rstart + row->rsize - E.coloff;
       if (len<0)
          len =0;
       if (len > E.screenCols)
           len = E.screenCols;
 
-      //abAppend(ab, &E.row[filerow].render[E.coloff], len);
-      char *c = &E.row[filerow].render[E.coloff];
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
-      int current_color = -1;
-      int j;
-      for (j = 0; j < len; j++) 
+      char *c = &row->render[E.coloff - rstart];
+      int hlruns = E.syntax ? row->hlruns : 0;      //Draw the latest snapshot, never wait for one
+      //First run that ends after the first column drawn
+      int run = 0, hi = hlruns;
+      while (run < hi)
       {
-        if (iscntrl(c[j])) 
-         {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-         }
-         if (current_color != -1) 
-         {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            abAppend(ab, buf, clen);
-          }
-         else if (hl[j] == HL_NORMAL) 
-         {
-         if(current_color!=-1)
-         {
-          abAppend(ab, "\x1b[39m", 5);
-          current_color=-1;
-         }
-          abAppend(ab, &c[j], 1);
-        } 
-        else 
+        int mid = (run + hi) / 2;
+        if (HL_RUN_END(row->hl[mid]) <= E.coloff - hlstart)
+          run = mid + 1;
+        else
+          hi = mid;
+      }
+      //One span per stretch of one class: the highlight runs, cut where the search match starts and ends
+      int col = E.coloff, stop = E.coloff + len;
+      while (col < stop)
+      {
+        int hcol = col - hlstart;
+        while (run < hlruns && HL_RUN_END(row->hl[run]) <= hcol)
+          run++;
+        int h = HL_NORMAL, end = stop;
+        if (hcol < 0)
+          end = hlstart;
+        else if (run < hlruns)
+        {
+          h = HL_RUN_CLASS(row->hl[run]);
+          end = hlstart + HL_RUN_END(row->hl[run]);
+        }
+        if (filerow == E.findRow)
         {
-          int color = editorSyntaxToColor(hl[j]);
-          if (color != current_color) 
+          if (col < E.findRx)
+            end = end < E.findRx ? end : E.findRx;
+          else if (col < E.findRx + E.findLen)
           {
-            current_color = color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            abAppend(ab, buf, clen);
+            h = HL_MATCH;
+            end = end < E.findRx + E.findLen ? end : E.findRx + E.findLen;
           }
-          abAppend(ab, &c[j], 1);
         }
+        if (end > stop)
+          end = stop;
+        editorFramePut(i, col - E.coloff, &c[col - E.coloff], end - col, h, 0);
+        col = end;
       }
-      abAppend(ab, "\x1b[39m", 5);
-     
-
+      int j;
+      for (j = 0; j < len; j++) 
+      {
+        if (iscntrl((unsigned char)c[j])) 
+         {
+          int k = i * E.screenCols + j;
+          E.frame.ch[k] = (c[j] <= 26) ? '@' + c[j] : '?';
+          E.frame.hl[k] = HL_NORMAL;
+          E.frame.attr[k] = CELL_REVERSE;
+         }
+      }
+      if (row->flags & ROW_UNICODE)
+        editorDrawGlyphs(row, i, len);
     }    
-    
-    abAppend(ab, "\x1b[K", 3);      
-
-    abAppend(ab, "\r\n",2);
-
-}
+  }
 }
-void editorDrawStatusBar(struct abuf *ab) 
+
+void editorDrawStatusBar() 
 {
-  abAppend(ab, "\x1b[7m", 4);
   char status[80], rstatus[80];
   int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
     E.filename ? E.filename : "[No Name]", E.numRows,
     E.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-    E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numRows);
+  int rlen;
+  if (E.matchCur >= 0)
+    rlen = snprintf(rstatus, sizeof(rstatus), "match %d of %d | %s | %d/%d", E.matchCur + 1,
+      E.matchCount, E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numRows);
+  else
+    rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
+      E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numRows);
   if (len > E.screenCols) len = E.screenCols;
-  abAppend(ab, status, len);
-  while (len < E.screenCols) 
+  int x = editorFramePutText(E.screenRows, 0, status, len, HL_NORMAL, CELL_REVERSE);
+  while (x < E.screenCols) 
   {
-    if (E.screenCols - len == rlen) 
-    {
-      abAppend(ab, rstatus, rlen);
-      break;
-    } 
+    if (E.screenCols - x == rlen) 
+      x = editorFramePut(E.screenRows, x, rstatus, rlen, HL_NORMAL, CELL_REVERSE);
     else 
-    {
-    abAppend(ab, " ", 1);
-    len++;
-   }
+      x = editorFramePut(E.screenRows, x, " ", 1, HL_NORMAL, CELL_REVERSE);
   }
-  abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2);
 }
 
-void editorDrawMessageBar(struct abuf *ab) 
+void editorDrawMessageBar() 
 {
-  abAppend(ab, "\x1b[K", 3);
-  int msglen = strlen(E.statusmsg);
+  char debug[160];
+  const char *msg = E.statusmsg;
+  E.statusShown = E.statusmsg[0] && time(NULL) - E.statusmsg_time < STATUS_TIMEOUT;
+  if (!E.statusShown)
+  {
+    msg = "";
+    if (E.debug)
+    {
+      struct rowMem *m = &E.rowMem;
+      snprintf(debug, sizeof(debug), "out: %lu B last key, %.0f B/key avg | rows: %zu KB in use, "
+        "%zu KB slabs, %zu KB big, %lu alloc %lu free %lu moved %lu fit",
+        E.lastKeyBytes, E.keys ? (double)E.outBytes / E.keys : 0.0, m->used >> 10,
+        m->slabBytes >> 10, m->bigBytes >> 10, m->allocs, m->frees, m->grows, m->fits);
+      msg = debug;
+    }
+  }
+  int msglen = strlen(msg);
   if (msglen > E.screenCols)
        msglen = E.screenCols;
-  if (msglen && time(NULL) - E.statusmsg_time < 5)
-       abAppend(ab, E.statusmsg, msglen);
+  editorFramePutText(E.screenRows + 1, 0, msg, msglen, HL_NORMAL, 0);
+}
+
+//(Re)allocate the frame and the shadow when the screen size changed
+void editorFrameResize()
+{
+  int rows = E.screenRows + 2;
+  if (E.frame.ch && rows == E.frameRows && E.screenCols == E.frameCols)
+    return;
+  struct grid *g[2] = {&E.frame, &E.shadow};
+  int k;
+  for (k = 0; k < 2; k++)
+  {
+    //One block for all the planes
+    free(g[k]->ch);
+    g[k]->ch = malloc((3 + CELL_GLYPH) * rows * E.screenCols);
+    if (g[k]->ch == NULL)
+      die("malloc");
+    g[k]->hl = (unsigned char *)g[k]->ch + rows * E.screenCols;
+    g[k]->attr = g[k]->hl + rows * E.screenCols;
+    g[k]->glyph = (char *)g[k]->attr + rows * E.screenCols;
+  }
+  E.frameRows = rows;
+  E.frameCols = E.screenCols;
+  E.shadowValid = 0;
+}
+
+int cellBlank(struct grid *g, int i)
+{
+  return g->ch[i] == ' ' && g->hl[i] == HL_NORMAL && g->attr[i] == 0;
+}
+
+int cellSame(int i)
+{
+  if (E.frame.ch[i] != E.shadow.ch[i] || E.frame.hl[i] != E.shadow.hl[i] || E.frame.attr[i] != E.shadow.attr[i])
+    return 0;
+  const char *a = &E.frame.glyph[i * CELL_GLYPH], *b = &E.shadow.glyph[i * CELL_GLYPH];
+  return E.frame.ch[i] != RENDER_GLYPH || !memcmp(a, b, a[0] + 1);
+}
+
+//Switch the terminal to the colors and attributes of a cell if it isn't there already
+void editorEmitAttr(struct abuf *ab, int hl, int attr)
+{
+  if (attr != E.termAttr)
+  {
+    if (attr & CELL_REVERSE)
+      abAppend(ab, "\x1b[7m", 4);
+    else
+      abAppend(ab, "\x1b[27m", 5);
+    E.termAttr = attr;
+  }
+  if (hl != E.termHl)
+  {
+    abAppend(ab, E.themeSgr[hl], E.themeSgrLen[hl]);
+    E.termHl = hl;
+  }
+}
+
+//Scroll the text area of the terminal and the shadow along with it
+void editorEmitScroll(struct abuf *ab, int n)
+{
+  char buf[32];
+  int rows = E.screenRows;
+  int cols = E.screenCols;
+  int shift = n > 0 ? n : -n;
+  editorEmitAttr(ab, HL_NORMAL, 0);
+  int blen = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r", rows, shift, n > 0 ? 'S' : 'T');
+  abAppend(ab, buf, blen);
+  int to = n > 0 ? 0 : shift * cols;
+  int from = n > 0 ? shift * cols : 0;
+  memmove(&E.shadow.ch[to], &E.shadow.ch[from], (rows - shift) * cols);
+  memmove(&E.shadow.hl[to], &E.shadow.hl[from], (rows - shift) * cols);
+  memmove(&E.shadow.attr[to], &E.shadow.attr[from], (rows - shift) * cols);
+  memmove(&E.shadow.glyph[to * CELL_GLYPH], &E.shadow.glyph[from * CELL_GLYPH], (rows - shift) * cols * CELL_GLYPH);
+  editorGridClear(&E.shadow, n > 0 ? (rows - shift) * cols : 0, shift * cols);
+}
+
+//Write n cells of the frame from i on, the ASCII in bulk and other characters from the glyph plane
+void editorEmitCells(struct abuf *ab, int i, int n)
+{
+  const char *ch = &E.frame.ch[i];
+  int j = 0;
+  while (j < n)
+  {
+    int k = j + wideKernel(&ch[j], n - j);
+    abAppend(ab, &ch[j], k - j);
+    if (k < n && ch[k] == RENDER_GLYPH)
+    {
+      const char *g = &E.frame.glyph[(i + k) * CELL_GLYPH];
+      abAppend(ab, g + 1, g[0]);
+    }
+    j = k + 1;                                      //RENDER_WIDE cells are covered by the one before
+  }
+}
+
+//Write the lines of the frame that differ from the shadow
+void editorEmitFrame(struct abuf *ab)
+{
+  int cols = E.screenCols;
+  int y;
+  if (E.shadowValid && E.coloff == E.shadowColoff && E.rowoff != E.shadowRowoff &&
+      abs(E.rowoff - E.shadowRowoff) < E.screenRows)
+    editorEmitScroll(ab, E.rowoff - E.shadowRowoff);
+  for (y = 0; y < E.frameRows; y++)
+  {
+    int base = y * cols;
+    int first = 0, last = cols - 1;
+    if (E.shadowValid)
+    {
+      while (first < cols && cellSame(base + first))
+        first++;
+      if (first == cols)
+        continue;
+      while (cellSame(base + last))
+        last--;
+      if (first > 0 && E.frame.ch[base + first] == RENDER_WIDE)
+        first--;                                      //Start with the character the cell is half of
+    }
+    int blank = cols;                                 //Everything from here on is blank
+    while (blank > 0 && cellBlank(&E.frame, base + blank - 1))
+      blank--;
+
+    char buf[32];
+    int blen = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, first + 1);
+    abAppend(ab, buf, blen);
+    int end = (blank <= last) ? blank : last + 1;
+    const unsigned char *hl = &E.frame.hl[base], *attr = &E.frame.attr[base];
+    int x = first;
+    while (x < end)
+    {
+      //One attribute change and one copy for every run of cells that look alike
+      int run = x + 1;
+      while (run < end && hl[run] == hl[x] && attr[run] == attr[x])
+        run++;
+      editorEmitAttr(ab, hl[x], attr[x]);
+      editorEmitCells(ab, base + x, run - x);
+      x = run;
+    }
+    if (blank <= last)
+    {
+      editorEmitAttr(ab, HL_NORMAL, 0);
+      abAppend(ab, "\x1b[K", 3);
+    }
+    memcpy(&E.shadow.ch[base], &E.frame.ch[base], cols);
+    memcpy(&E.shadow.hl[base], &E.frame.hl[base], cols);
+    memcpy(&E.shadow.attr[base], &E.frame.attr[base], cols);
+    for (x = 0; (x += wideKernel(&E.frame.ch[base + x], cols - x)) < cols; x++)
+      if (E.frame.ch[base + x] == RENDER_GLYPH)
+        memcpy(&E.shadow.glyph[(base + x) * CELL_GLYPH], &E.frame.glyph[(base + x) * CELL_GLYPH],
+          E.frame.glyph[(base + x) * CELL_GLYPH] + 1);
+  }
+  E.shadowValid = 1;
+  E.shadowRowoff = E.rowoff;
+  E.shadowColoff = E.coloff;
+}
+
+//write() all of it, counting what goes to the terminal
+void editorWrite(const char *s, int len)
+{
+  while (len > 0)
+  {
+    ssize_t n = write(STDOUT_FILENO, s, len);
+    if (n == -1)
+    {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      return;
+    }
+    s += n;
+    len -= n;
+    E.outBytes += n;
+    E.keyBytes += n;
+  }
 }
 
 void editorRefreshScreen()
 {
+  E.frameDue = 0;
   editorScroll();
-  struct abuf ab = ABUF_INIT;
-  abAppend(&ab, "\x1b[?25l", 6);                              //Hide the cursor
-  abAppend(&ab, "\x1b[H", 3);                                 // Reposition the cursor at the top left corner
-  
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+  editorFrameResize();
+  editorGridClear(&E.frame, 0, E.frameRows * E.screenCols);
+  editorDrawRows();
+  editorDrawStatusBar();
+  editorDrawMessageBar();
+  editorRequestHighlight();
+
+  struct abuf *ab = &screenBuf;
+  abReset(ab);
+  abAppend(ab, "\x1b[?25l", 6);                              //Hide the cursor
+  editorEmitFrame(ab);
+  int cy = (E.cy - E.rowoff) + 1;
+  int cx = (E.rx - E.coloff) + 1;
+  if (ab->len == 6 && cy == E.termCy && cx == E.termCx)
+    return;                                                   //Nothing changed on screen
 
   char buffer[32];
-  snprintf(buffer, sizeof(buffer), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,(E.rx - E.coloff) + 1);
-  abAppend(&ab, buffer, strlen(buffer));
-  abAppend(&ab, "\x1b[?25h", 6);                             //Show the cursor
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+  snprintf(buffer, sizeof(buffer), "\x1b[%d;%dH", cy, cx);
+  abAppend(ab, buffer, strlen(buffer));
+  abAppend(ab, "\x1b[?25h", 6);                             //Show the cursor
+  editorWrite(ab->b, ab->len);
+  E.termCy = cy;
+  E.termCx = cx;
 }
 
 //Function to print a status message at the bottom of the screen
@@ -1067,6 +6671,25 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int))
       free(buf);
       return NULL;
     }
+    else if (c == PASTE_START)
+    {
+      //Only the first line of the paste goes into the prompt
+      size_t len;
+      char *text = editorReadPaste(&len);
+      for (size_t i = 0; i < len && text[i] != '\n'; i++)
+      {
+        if (iscntrl(text[i]) || (unsigned char)text[i] >= 128)
+          continue;
+        if (buflen == bufsize - 1) 
+        {
+          bufsize *= 2;
+          buf = realloc(buf, bufsize);
+        }
+        buf[buflen++] = text[i];
+        buf[buflen] = '\0';
+      }
+      free(text);
+    }
     else if (c == '\r')
     {     
    
@@ -1095,23 +6718,23 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int))
 }
 
 void  editorMoveCursor(int key) {
-  erow *row = (E.cy >= E.numRows) ? NULL : &E.row[E.cy];
+  erow *row = (E.cy >= E.numRows) ? NULL : editorRowAt(E.cy);
   switch (key) {
     case ARROW_LEFT:
      if(E.cx!=0)
      {
-      E.cx--;
+      E.cx = editorRowPrevCx(row, E.cx);
      }
      else if (E.cy > 0)
      {
         E.cy--;
-        E.cx = E.row[E.cy].size;
+        E.cx = editorRowAt(E.cy)->size;
      } 
      break;
     case ARROW_RIGHT:
      if(row && E.cx<row->size)
      {
-      E.cx++;
+      E.cx = editorRowNextCx(row, E.cx);
      }
      else if (row && E.cx == row->size) 
      {
@@ -1132,18 +6755,28 @@ void  editorMoveCursor(int key) {
     }
       break;
   }
-  row = (E.cy >= E.numRows) ? NULL : &E.row[E.cy];
+  row = (E.cy >= E.numRows) ? NULL : editorRowAt(E.cy);
   int rowlen = row ? row->size : 0;
   if (E.cx > rowlen) 
   {
     E.cx = rowlen;
   }
+  if (row && E.cx < rowlen)
+    E.cx = editorRowPrevCx(row, E.cx + 1);             //Not in the middle of a character
 }
 
 void editorProcessKeypress()
 {
  int  c = editorReadKey();
+ E.lastKeyBytes = E.keyBytes;
+ E.keyBytes = 0;
+ E.keys++;
+ E.findRow = -1;
+ E.matchCur = -1;
  static int quit_times= QUIT_TIMES; 
+ //Typing and backspacing keep adding to the same undo record, anything else ends it
+ if (c != '\r' && c != BACKSPACE && c != CNTRL_KEY('h') && (iscntrl(c) || c > 127))
+   editorUndoSeal();
  switch(c)
  {
    case '\r':
@@ -1193,11 +6826,15 @@ void editorProcessKeypress()
       break;
   case END_KEY:
       if (E.cy < E.numRows)
-        E.cx = E.row[E.cy].size;
+        E.cx = editorRowAt(E.cy)->size;
       break;
   case CNTRL_KEY('f'):
       editorFind();
       break;
+  case CNTRL_KEY('n'):
+  case CNTRL_KEY('p'):
+      editorFindNext(c == CNTRL_KEY('n') ? 1 : -1);
+      break;
   case BACKSPACE:
   case CNTRL_KEY('h'):
   case DEL_KEY:
@@ -1206,7 +6843,29 @@ void editorProcessKeypress()
       editorDelChar();
       break;
 
+  case CNTRL_KEY('d'):
+      E.debug = !E.debug;
+      break;
+
+  case PASTE_START:
+      {
+        size_t len;
+        char *text = editorReadPaste(&len);
+        editorInsertTextAtCursor(text, len);
+        free(text);
+      }
+      break;
+
+  case CNTRL_KEY('z'):
+      editorUndo();
+      break;
+  case CNTRL_KEY('y'):
+      editorRedo();
+      break;
+
   case CNTRL_KEY('l'):
+      E.shadowValid = 0;                                   //Repaint everything
+      break;
   case '\x1b':
       break;
   case CNTRL_KEY('s'):
@@ -1219,6 +6878,236 @@ void editorProcessKeypress()
    quit_times = QUIT_TIMES;
 }
 
+/*** event loop ***/
+
+double editorMsSince(struct timespec *t)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - t->tv_sec) * 1e3 + (now.tv_nsec - t->tv_nsec) / 1e6;
+}
+
+//Milliseconds until the status message on screen goes away, -1 if there is none
+int editorStatusTimeout()
+{
+  if (!E.statusShown)
+    return -1;
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  long ms = (E.statusmsg_time + STATUS_TIMEOUT - now.tv_sec) * 1000L - now.tv_nsec / 1000000;
+  return ms > 0 ? ms : 0;
+}
+
+/*
+ Keys are applied as soon as they arrive, but a frame is drawn at most
+ every FRAME_MS, timed from the end of the last one. When drawing is slow
+ (a key held down on a very long line) the keys that came in meanwhile are
+ all applied before the next frame instead of each getting a stale frame
+ of its own. Resizes, new highlighting and the status message timing out
+ also ask for a frame.
+*/
+void editorRun()
+{
+  struct timespec lastFrame = {0, 0};
+  while (1)
+  {
+    while (editorInputPending())
+    {
+      editorProcessKeypress();
+      E.frameDue = 1;
+      if (editorMsSince(&lastFrame) >= FRAME_MS)
+        break;
+    }
+    int timeout = -1;
+    if (E.frameDue)
+    {
+      double since = editorMsSince(&lastFrame);
+      if (since >= FRAME_MS)
+      {
+        editorRefreshScreen();
+        clock_gettime(CLOCK_MONOTONIC, &lastFrame);
+      }
+      else
+        timeout = FRAME_MS - (int)since;
+    }
+    if (!E.frameDue)
+      timeout = editorStatusTimeout();
+    if (timeout == 0)
+    {
+      E.frameDue = 1;
+      continue;
+    }
+    if (E.inHead != E.inTail)
+      continue;                                     //Keys read along with the last one are still in the ring
+    pthread_mutex_unlock(&E.lock);
+    editorWaitEvents(timeout);
+    pthread_mutex_lock(&E.lock);
+  }
+}
+
+/*** benchmarks ***/
+
+double benchSeconds(struct timespec *t0)
+{
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+//Highlight every line of the file with one lexer, carrying the comment state
+double benchHighlightPass(int (*hlLine)(struct editorSyntax *, const char *, int, unsigned char *, int),
+  char *buf, size_t size, unsigned char *hl, int rounds)
+{
+  struct timespec t0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int r = 0; r < rounds; r++)
+  {
+    int in_comment = 0;
+    size_t off = 0;
+    while (off < size)
+    {
+      char *nl = memchr(&buf[off], '\n', size - off);
+      size_t len = nl ? (size_t)(nl - &buf[off]) : size - off;
+      in_comment = hlLine(E.syntax, &buf[off], len, &hl[off], in_comment);
+      off += len + 1;
+    }
+  }
+  return benchSeconds(&t0);
+}
+
+/*
+ --bench-highlight FILE: time the compiled lexer against the reference loop
+ on the raw lines of FILE and check that both color every byte the same.
+*/
+int editorBenchHighlight(const char *path)
+{
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+  {
+    perror(path);
+    return 1;
+  }
+  fseek(fp, 0, SEEK_END);
+  size_t size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  char *buf = malloc(size + 1);
+  unsigned char *ref = malloc(size + 1);
+  unsigned char *dfa = malloc(size + 1);
+  if (buf == NULL || ref == NULL || dfa == NULL)
+    die("malloc");
+  if (fread(buf, 1, size, fp) != size)
+    die("fread");
+  fclose(fp);
+
+  E.filename = strdup(path);
+  editorSelectSyntaxHighlight();
+  if (E.syntax == NULL)
+  {
+    fprintf(stderr, "%s: no syntax for this file type\n", path);
+    return 1;
+  }
+  if (E.syntax->dfa == NULL)
+    printf("%s: syntax can't be compiled, both runs use the reference loop\n", E.syntax->filetype);
+
+  int rounds = size < (1 << 24) ? (1 << 24) / (size + 1) + 1 : 1;
+  double mb = (double)size * rounds / (1 << 20);
+  double tRef = benchHighlightPass(editorHighlightLineRef, buf, size, ref, rounds);
+  double tDfa = benchHighlightPass(editorHighlightLine, buf, size, dfa, rounds);
+
+  size_t diff = 0;
+  for (size_t i = 0; i < size; i++)
+    if (buf[i] != '\n' && ref[i] != dfa[i])
+      diff++;
+  printf("%s, %zu bytes x %d\n", E.syntax->filetype, size, rounds);
+  printf("reference: %8.1f MB/s\n", mb / tRef);
+  printf("dfa:       %8.1f MB/s (%.2fx, %d states, %d classes)\n", mb / tDfa, tRef / tDfa,
+    E.syntax->dfa ? E.syntax->dfa->nstates : 0, E.syntax->dfa ? E.syntax->dfa->nclass : 0);
+  printf("%zu bytes highlighted differently\n", diff);
+  free(buf);
+  free(ref);
+  free(dfa);
+  return diff != 0;
+}
+
+/*
+ --bench-regex PATTERN FILE: count the lines of FILE the pattern matches, with
+ the engine Ctrl-F uses and with the C library's regexec, and compare.
+*/
+int editorBenchRegex(const char *pattern, const char *path)
+{
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+  {
+    perror(path);
+    return 1;
+  }
+  fseek(fp, 0, SEEK_END);
+  size_t size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  char *buf = malloc(size + 1);
+  if (buf == NULL)
+    die("malloc");
+  if (fread(buf, 1, size, fp) != size)
+    die("fread");
+  buf[size] = '\0';
+  fclose(fp);
+
+  struct regex *re = reCompile(pattern);
+  regex_t posix;
+  if (re == NULL || regcomp(&posix, pattern, REG_EXTENDED | REG_NOSUB) != 0)
+  {
+    fprintf(stderr, "%s: pattern not supported\n", pattern);
+    return 1;
+  }
+  selectFindKernel();
+  struct reCache *c = reCacheNew(re);
+  double mb = (double)size / (1 << 20);
+  long ours = 0, theirs = 0;
+  struct timespec t0;
+  size_t off;
+  int len;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (off = 0; off < size; )
+  {
+    char *nl = memchr(&buf[off], '\n', size - off);
+    size_t n = nl ? (size_t)(nl - &buf[off]) : size - off;
+    if (reSearch(re, c, &buf[off], n, 0, &len) >= 0)
+      ours++;
+    off += n + 1;
+  }
+  double tOurs = benchSeconds(&t0);
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (off = 0; off < size; )
+  {
+    char *nl = memchr(&buf[off], '\n', size - off);
+    size_t n = nl ? (size_t)(nl - &buf[off]) : size - off;
+#ifdef REG_STARTEND
+    regmatch_t m = { 0, n };
+    if (regexec(&posix, &buf[off], 1, &m, REG_STARTEND) == 0)
+      theirs++;
+#else
+    char save = buf[off + n];
+    buf[off + n] = '\0';
+    if (regexec(&posix, &buf[off], 0, NULL, 0) == 0)
+      theirs++;
+    buf[off + n] = save;
+#endif
+    off += n + 1;
+  }
+  double tTheirs = benchSeconds(&t0);
+
+  printf("%s on %s, %.1f MB\n", pattern, path, mb);
+  printf("dfa+nfa: %8.1f MB/s, %ld matching lines\n", mb / tOurs, ours);
+  printf("regexec: %8.1f MB/s, %ld matching lines (%.1fx slower)\n", mb / tTheirs, theirs, tTheirs / tOurs);
+  reCacheFree(c);
+  reFree(re);
+  regfree(&posix);
+  free(buf);
+  return ours != theirs;
+}
+
 /***INIT***/
 
 void initEditor()
@@ -1227,13 +7116,20 @@ void initEditor()
  E.cy=0;
  E.numRows=0;
  E.row=NULL;
+ E.rowCap=0;
+ E.gapStart=0;
  E.rowoff=0;
  E.coloff=0;
  E.rx=0;
  E.filename=NULL; 
+ E.map=NULL;
+ E.mapSize=0;
+ E.mapHeap=0;
  E.statusmsg[0]='\0';
  E.statusmsg_time=0;
  E.dirty=0;
+ const char *fsyncEnv = getenv("EDITOR_FSYNC");
+ E.saveFsync = fsyncEnv && fsyncEnv[0] >= '0' && fsyncEnv[0] <= '2' && !fsyncEnv[1] ? fsyncEnv[0] - '0' : SAVE_FSYNC;
  int i = getWindowSize(&E.screenRows,&E.screenCols);
  if(i==-1)
   {
@@ -1241,6 +7137,36 @@ void initEditor()
   }
   E.screenRows -=2;
   E.syntax=NULL;
+  E.hlCheck=NULL;
+  E.hlCheckCap=0;
+  E.hlCheckValid=1;
+  E.hlVersion=0;
+  pthread_mutex_init(&E.lock, NULL);
+  pthread_cond_init(&E.hlCond, NULL);
+  E.hlRequest=0;
+  E.hlTop=0;
+  E.hlRows=0;
+  E.hlPipe[0]=E.hlPipe[1]=-1;
+  E.winchPipe[0]=E.winchPipe[1]=-1;
+  E.frameDue=1;
+  E.statusShown=0;
+  E.frame.ch=NULL;
+  E.shadow.ch=NULL;
+  E.frameRows=0;
+  E.frameCols=0;
+  E.shadowValid=0;
+  E.termHl=-1;
+  E.termAttr=-1;
+  E.termCy=0;
+  E.termCx=0;
+  E.outBytes=0;
+  E.keyBytes=0;
+  E.lastKeyBytes=0;
+  E.keys=0;
+  E.debug=0;
+  E.findRow=-1;
+  E.matchCur=-1;
+  E.matchFrom=-1;
 }
 
 
@@ -1250,18 +7176,25 @@ void initEditor()
 
 int main(int argc, char *argv[]) 
 {
+  if (argc == 3 && !strcmp(argv[1], "--bench-highlight"))
+    return editorBenchHighlight(argv[2]);
+  if (argc == 4 && !strcmp(argv[1], "--bench-regex"))
+    return editorBenchRegex(argv[2], argv[3]);
   enableRawMode();
   initEditor();
+  selectScanKernel();
+  selectFindKernel();
+  selectWideKernel();
+  editorWatchResize();
+  editorStartHighlighter();
+  editorSetStatusMessage("HELP: Ctrl+Q = quit | Ctrl+s = Save | Ctrl+f = Find | Ctrl+n/p = Next/Prev | Ctrl+z/y = Undo/Redo");
+  editorDetectColors();
+  editorLoadTheme();
   if(argc>=2)
    {
      editorOpen(argv[1]);
    }
-  editorSetStatusMessage("HELP: Ctrl+Q = quit | Ctrl+s = Save | Ctrl+f = Find");
-  while (1) 
-   {
-    editorRefreshScreen(); 
-    editorProcessKeypress();
-   }
+  editorRun();
 
   return 0;
 }